@@ -19,12 +19,42 @@
 #include <float.h>
 #include <assert.h>
 #include <cctype>
+#include <bitset>
+#include <fstream>
+#include <sstream>
+#include <iomanip>
+#include <numeric>
+#include <random>
+#include <thread>
+#include <atomic>
+#include <mutex>
 
 using namespace std;
 
+#ifdef DEBUG_GAMESTATE
+atomic<int> debug_chain_moves(0); // moves onto the cell of another of our units leaving it in the same batch, see apply_moves
+#endif
+
 #define GA_TURNS 6
 #define GA_POPULATION_SIZE 100
-#define GA_MAX_GENERATIONS 800
+#define GA_MAX_GENERATIONS 5000
+#ifndef GA_ISLANDS
+#define GA_ISLANDS 1 // each evolved on its own thread but the first, so a single island is serial as CodinGame has one core
+#endif
+#ifdef RHEA_PLANNER
+#define RHEA_TURNS 4
+#define RHEA_POPULATION_SIZE 16
+#define RHEA_MAX_GENERATIONS 300
+#define RHEA_DISCOUNT 0.9
+#endif
+#define ROUTE_TURNS 4 // turns ahead the cooperative unit routes are planned for
+#define CUT_TABLE_SIZE 4096 // entries of the cut transposition table, a power of two
+#define CUT_SELECTION_SIZE 24 // best candidate cuts considered together
+#define LETHAL_MAX_NODES 4096 // chains tried by the lethal search in a turn
+#define THREAT_PATH_BONUS 20.0 // objective score of a cell on the enemy's chainkill to our HQ
+#define TURN_TIME_FIRST_MS 1000.0
+#define TURN_TIME_MS 50.0
+#define TURN_TIME_MARGIN_MS 10.0
 
 const int height = 12;
 const int width = 12;
@@ -35,6 +65,11 @@ const int level_3_cost = 30;
 const int level_1_upkeep = 1;
 const int level_2_upkeep = 4;
 const int level_3_upkeep = 20;
+const int mine_cost = 20;
+const int mine_cost_increment = 4;
+const int mine_income = 4;
+const int starting_gold = 20;
+const int unreachable_distance = 255;
 
 const char moves[5] = { 'n', 's', 'e', 'w', 'o' };
 
@@ -52,6 +87,20 @@ enum CommandType
 	BUILD
 };
 
+enum Phase
+{
+	PHASE_GA,
+	PHASE_MOVES,
+	PHASE_CHAINKILL,
+	PHASE_CUTS,
+	PHASE_TOWERS,
+	PHASE_TRAIN_ON_CUTS,
+	PHASE_TRAIN,
+	PHASE_COUNT
+};
+const double phase_weights[PHASE_COUNT] = { 1.0, 2.0, 1.0, 4.0, 2.0, 1.0, 1.0 };
+const char* phase_names[PHASE_COUNT] = { "GA", "Moves", "Chainkill", "Cuts", "Towers", "Train on cuts", "Train" };
+
 ostream& operator<<(ostream &os, CommandType cmdType)
 {
 	switch (cmdType)
@@ -87,6 +136,86 @@ public:
 	string identifier;
 	chrono::time_point<chrono::high_resolution_clock> start;
 };
+class TimeBudget
+{
+public:
+	TimeBudget() : limit_ms(0.0), phase_limit_ms(0.0), weights_left(0.0), unlimited(false), current_phase(PHASE_COUNT), phase_start_ms(0.0) {}
+
+	// Called as soon as the first line of the turn is read, the referee's clock starts there
+	void start_turn(double limit_ms)
+	{
+		turn_start = chrono::high_resolution_clock::now();
+		this->limit_ms = limit_ms;
+		phase_limit_ms = limit_ms;
+		weights_left = 0.0;
+		current_phase = PHASE_COUNT;
+		fill(phase_ms, phase_ms + PHASE_COUNT, -1.0);
+	}
+	void plan(const vector<Phase>& phases)
+	{
+		weights_left = 0.0;
+		for (auto phase : phases)
+			weights_left += phase_weights[phase];
+	}
+	// A phase gets its weighted share of what is left of the turn, so time unused by earlier phases rolls over
+	void start_phase(Phase phase)
+	{
+		finish_phase();
+		current_phase = phase;
+		phase_start_ms = elapsed_ms();
+		phase_ms[phase] = max(phase_ms[phase], 0.0);
+
+		double share = (weights_left > phase_weights[phase]) ? phase_weights[phase] / weights_left : 1.0;
+		weights_left = max(0.0, weights_left - phase_weights[phase]);
+		phase_limit_ms = elapsed_ms() + remaining_ms() * share;
+	}
+	void finish_phase()
+	{
+		if (current_phase != PHASE_COUNT)
+			phase_ms[current_phase] += elapsed_ms() - phase_start_ms;
+		current_phase = PHASE_COUNT;
+	}
+
+	inline double elapsed_ms() const { return chrono::duration<double, milli>(chrono::high_resolution_clock::now() - turn_start).count(); }
+	inline double remaining_ms() const { return max(0.0, limit_ms - elapsed_ms()); }
+	inline double phase_remaining_ms() const { return max(0.0, phase_limit_ms - elapsed_ms()); }
+	inline bool phase_expired() const { return !unlimited && elapsed_ms() >= phase_limit_ms; }
+	inline bool turn_expired() const { return !unlimited && elapsed_ms() >= limit_ms; }
+
+	chrono::time_point<chrono::high_resolution_clock> turn_start;
+	double limit_ms;
+	double phase_limit_ms;
+	double weights_left;
+	bool unlimited; // never expires, keeps offline replays deterministic
+
+	Phase current_phase;
+	double phase_start_ms;
+	double phase_ms[PHASE_COUNT]; // time spent in each phase this turn, negative if it did not run
+};
+
+// Copies everything read through it to a recording, see RECORD_INPUT
+class RecordingBuffer : public streambuf
+{
+public:
+	RecordingBuffer(streambuf* source, ostream& recording) : source(source), recording(recording) {}
+
+protected:
+	int_type underflow() override { return source->sgetc(); }
+	int_type uflow() override
+	{
+		int_type c = source->sbumpc();
+		if (!traits_type::eq_int_type(c, traits_type::eof()))
+		{
+			recording.put(traits_type::to_char_type(c));
+			if (traits_type::to_char_type(c) == '\n')
+				recording.flush();
+		}
+		return c;
+	}
+
+	streambuf* source;
+	ostream& recording;
+};
 template<typename T, typename priority_t> struct MinPriorityQueue
 {
 	struct CompareT
@@ -195,17 +324,6 @@ void print_hashmap_positions(const unordered_map<Position, double, HashPosition>
 		str += position.first.print() + ": " + to_string(position.second) + ", ";
 	cerr << str << endl;
 }
-void print_hashmap_vector_positions(const unordered_map<Position, vector<Position>, HashPosition>& positions, string tag)
-{
-	cerr << tag + ": " << endl;
-	for (auto& position_vector : positions)
-	{
-		string str = position_vector.first.print() + ": ";
-		for (auto& position : position_vector.second)
-			str += position.print() + ", ";
-		cerr << str << endl;
-	}
-}
 void print_vector_vector(vector<vector<double>> vv)
 {
 	for (auto& row : vv)
@@ -225,6 +343,360 @@ void print_vector_vector(int vv[][height])
 	}
 }
 
+class Bitboard
+{
+public:
+	// bit index is x + width * y
+	bitset<width * height> bits;
+
+	Bitboard() {}
+	Bitboard(const bitset<width * height>& bits) : bits(bits) {}
+
+	inline static int index(const Position& position) { return position.x + width * position.y; }
+	inline static Position position(int index) { return Position(index % width, index / width); }
+	inline static Bitboard from(const Position& position) { Bitboard board; board.set(position); return board; }
+	inline static Bitboard from(const vector<Position>& positions) { Bitboard board; for (auto& position : positions) board.set(position); return board; }
+
+	inline bool test(const Position& position) const { return bits.test(index(position)); }
+	inline void set(const Position& position) { bits.set(index(position)); }
+	inline void reset(const Position& position) { bits.reset(index(position)); }
+	inline void clear() { bits.reset(); }
+	inline int count() const { return (int)bits.count(); }
+	inline bool any() const { return bits.any(); }
+	inline bool none() const { return bits.none(); }
+
+	inline Bitboard operator&(const Bitboard& rhs) const { return Bitboard(bits & rhs.bits); }
+	inline Bitboard operator|(const Bitboard& rhs) const { return Bitboard(bits | rhs.bits); }
+	inline Bitboard operator^(const Bitboard& rhs) const { return Bitboard(bits ^ rhs.bits); }
+	inline Bitboard operator-(const Bitboard& rhs) const { return Bitboard(bits & ~rhs.bits); }
+	inline Bitboard operator~() const { return Bitboard(~bits); }
+	inline Bitboard& operator&=(const Bitboard& rhs) { bits &= rhs.bits; return *this; }
+	inline Bitboard& operator|=(const Bitboard& rhs) { bits |= rhs.bits; return *this; }
+	inline bool operator==(const Bitboard& rhs) const { return bits == rhs.bits; }
+	inline bool operator!=(const Bitboard& rhs) const { return bits != rhs.bits; }
+
+	// cells 4-adjacent to a cell of the set, which includes the cells of the set next to another one of it
+	inline Bitboard neighbours() const
+	{
+		return Bitboard(((bits << 1) & not_first_column().bits) | ((bits >> 1) & not_last_column().bits) | (bits << width) | (bits >> width));
+	}
+	inline Bitboard dilate() const { return *this | neighbours(); }
+
+	// cells at path distance <= distance from the set, walking through passable cells only
+	Bitboard dilate(int distance, const Bitboard& passable) const
+	{
+		Bitboard board = *this;
+		for (int i = 0; i < distance; i++)
+			board = board.dilate() & passable;
+		return board;
+	}
+
+	// cells of mask connected to the set
+	Bitboard flood_fill(const Bitboard& mask) const
+	{
+		Bitboard filled = *this & mask;
+		Bitboard previous;
+		do
+		{
+			previous = filled;
+			filled = filled.dilate() & mask;
+		} while (filled != previous);
+		return filled;
+	}
+
+	// column by column, same order as the x/y loops over the grid
+	vector<Position> to_positions() const
+	{
+		vector<Position> positions;
+		positions.reserve(count());
+		for (int i = 0; i < width; i++)
+			for (int j = 0; j < height; j++)
+				if (bits.test(i + width * j))
+					positions.push_back(Position(i, j));
+		return positions;
+	}
+
+	static const Bitboard& not_first_column()
+	{
+		static const Bitboard board = column_mask(0);
+		return board;
+	}
+	static const Bitboard& not_last_column()
+	{
+		static const Bitboard board = column_mask(width - 1);
+		return board;
+	}
+	static Bitboard column_mask(int excluded_column)
+	{
+		Bitboard board;
+		for (int i = 0; i < width; i++)
+			for (int j = 0; j < height; j++)
+				if (i != excluded_column)
+					board.set(Position(i, j));
+		return board;
+	}
+};
+
+class Adjacency
+{
+public:
+	// neighbours of the cell at Bitboard::index, at most 4 on the grid
+	Position neighbours[width * height][4];
+	int degree[width * height];
+
+	class Range
+	{
+	public:
+		const Position* first;
+		const Position* last;
+
+		inline const Position* begin() const { return first; }
+		inline const Position* end() const { return last; }
+		inline int size() const { return (int)(last - first); }
+		inline bool empty() const { return first == last; }
+	};
+
+	Adjacency() { clear(); }
+
+	inline void clear() { fill(degree, degree + width * height, 0); }
+	inline void clear(const Position& position) { degree[Bitboard::index(position)] = 0; }
+	inline void add(const Position& position, const Position& neighbour)
+	{
+		int index = Bitboard::index(position);
+		neighbours[index][degree[index]++] = neighbour;
+	}
+	inline Range operator[](const Position& position) const
+	{
+		int index = Bitboard::index(position);
+		return Range{ neighbours[index], neighbours[index] + degree[index] };
+	}
+	bool operator==(const Adjacency& rhs) const
+	{
+		for (int index = 0; index < width * height; index++)
+		{
+			if (degree[index] != rhs.degree[index])
+				return false;
+
+			for (int k = 0; k < degree[index]; k++)
+				if (!(neighbours[index][k] == rhs.neighbours[index][k]))
+					return false;
+		}
+		return true;
+	}
+};
+void print_adjacency(const Adjacency& adjacency, string tag)
+{
+	cerr << tag + ": " << endl;
+	for (int index = 0; index < width * height; index++)
+		if (adjacency.degree[index])
+		{
+			Position position = Bitboard::position(index);
+			string str = position.print() + ": ";
+			for (auto& neighbour : adjacency[position])
+				str += neighbour.print() + ", ";
+			cerr << str << endl;
+		}
+}
+
+// Dinic max flow on a graph of at most two nodes per cell plus a source and a sink, for minimum vertex cuts on the grid
+class MaxFlow
+{
+public:
+	static const int max_nodes = 2 * width * height + 2;
+	static const int max_edges = 2 * 6 * width * height; // split edge, 4 neighbours and a sink edge per cell, each with its reverse
+
+	int head[max_nodes];
+	int next_edge[max_edges];
+	int target[max_edges];
+	int capacity[max_edges];
+	int edge_count;
+	int node_count;
+	int level[max_nodes]; // BFS level in the residual graph, -1 if not reachable from the source
+	int current[max_nodes];
+
+	void clear(int nodes)
+	{
+		node_count = nodes;
+		edge_count = 0;
+		fill(head, head + nodes, -1);
+	}
+	// Edges and their reverse are stored side by side, so edge ^ 1 is the reverse
+	void add_edge(int from, int to, int edge_capacity)
+	{
+		target[edge_count] = to;
+		capacity[edge_count] = edge_capacity;
+		next_edge[edge_count] = head[from];
+		head[from] = edge_count++;
+
+		target[edge_count] = from;
+		capacity[edge_count] = 0;
+		next_edge[edge_count] = head[to];
+		head[to] = edge_count++;
+	}
+	// Stops as soon as the flow exceeds limit, the cut is then too expensive anyway.
+	// Afterwards level tells which nodes are on the source side of the minimum cut.
+	int run(int source, int sink, int limit)
+	{
+		int flow = 0;
+		while (bfs(source, sink) && flow <= limit)
+		{
+			copy(head, head + node_count, current);
+			while (int pushed = dfs(source, sink, INT_MAX))
+				flow += pushed;
+		}
+		return flow;
+	}
+
+private:
+	bool bfs(int source, int sink)
+	{
+		fill(level, level + node_count, -1);
+		int queue[max_nodes];
+		int first = 0, last = 0;
+		level[source] = 0;
+		queue[last++] = source;
+
+		while (first < last)
+		{
+			int node = queue[first++];
+			for (int edge = head[node]; edge >= 0; edge = next_edge[edge])
+				if (capacity[edge] > 0 && level[target[edge]] < 0)
+				{
+					level[target[edge]] = level[node] + 1;
+					queue[last++] = target[edge];
+				}
+		}
+
+		return level[sink] >= 0;
+	}
+	int dfs(int node, int sink, int pushed)
+	{
+		if (node == sink)
+			return pushed;
+
+		for (int& edge = current[node]; edge >= 0; edge = next_edge[edge])
+			if (capacity[edge] > 0 && level[target[edge]] == level[node] + 1)
+			{
+				int flow = dfs(target[edge], sink, min(pushed, capacity[edge]));
+				if (flow > 0)
+				{
+					capacity[edge] -= flow;
+					capacity[edge ^ 1] += flow;
+					return flow;
+				}
+			}
+
+		return 0;
+	}
+};
+
+// BFS path lengths from source through passable cells, unreachable_distance where there is no path
+void compute_distances_from(uint8_t row[width * height], int source, const Bitboard& passable)
+{
+	fill(row, row + width * height, (uint8_t)unreachable_distance);
+	row[source] = 0;
+
+	if (!passable.bits.test(source))
+		return;
+
+	int frontier[width * height];
+	int head = 0, tail = 0;
+	frontier[tail++] = source;
+
+	while (head < tail)
+	{
+		int current = frontier[head++];
+		uint8_t next_distance = row[current] + 1;
+
+		auto visit = [&](int next)
+		{
+			if (row[next] == unreachable_distance && passable.bits.test(next))
+			{
+				row[next] = next_distance;
+				frontier[tail++] = next;
+			}
+		};
+
+		int x = current % width;
+		if (current >= width)
+			visit(current - width);
+		if (current < width * (height - 1))
+			visit(current + width);
+		if (x < width - 1)
+			visit(current + 1);
+		if (x > 0)
+			visit(current - 1);
+	}
+}
+
+// Column of each row in the assignment of least total cost, with no more rows than columns (Hungarian algorithm with potentials)
+vector<int> solve_assignment(const vector<vector<double>>& cost)
+{
+	int rows = cost.size();
+	int columns = rows ? cost[0].size() : 0;
+
+	// Rows and columns from 1, column 0 holds the row being added
+	vector<double> row_potential(rows + 1, 0.0), column_potential(columns + 1, 0.0);
+	vector<int> row_of(columns + 1, 0), previous(columns + 1, 0);
+	for (int row = 1; row <= rows; row++)
+	{
+		row_of[0] = row;
+		int column = 0;
+		vector<double> slack(columns + 1, DBL_MAX);
+		vector<bool> visited(columns + 1, false);
+
+		// Grow alternating paths until one ends on a free column
+		do
+		{
+			visited[column] = true;
+			int current = row_of[column];
+			int next = 0;
+			double delta = DBL_MAX;
+			for (int j = 1; j <= columns; j++)
+				if (!visited[j])
+				{
+					double reduced = cost[current - 1][j - 1] - row_potential[current] - column_potential[j];
+					if (reduced < slack[j])
+					{
+						slack[j] = reduced;
+						previous[j] = column;
+					}
+					if (slack[j] < delta)
+					{
+						delta = slack[j];
+						next = j;
+					}
+				}
+
+			for (int j = 0; j <= columns; j++)
+				if (visited[j])
+				{
+					row_potential[row_of[j]] += delta;
+					column_potential[j] -= delta;
+				}
+				else
+					slack[j] -= delta;
+
+			column = next;
+		} while (row_of[column] != 0);
+
+		// Flip the path
+		do
+		{
+			int next = previous[column];
+			row_of[column] = row_of[next];
+			column = next;
+		} while (column);
+	}
+
+	vector<int> assignment(rows, -1);
+	for (int j = 1; j <= columns; j++)
+		if (row_of[j])
+			assignment[row_of[j] - 1] = j - 1;
+
+	return assignment;
+}
+
 class Objective
 {
 public:
@@ -248,12 +720,12 @@ public:
 	Command(CommandType t, int idOrLevel, const Position &p) : t(t), idOrLevel(idOrLevel), p(p) {}
 	Command(CommandType t, string building, const Position &p) : t(t), idOrLevel(-1), building(building), p(p) {}
 
-	void print()
+	void print(ostream& output)
 	{
 		if (idOrLevel >= 0)
-			cout << t << " " << idOrLevel << " " << p.x << " " << p.y << ";";
+			output << t << " " << idOrLevel << " " << p.x << " " << p.y << ";";
 		else
-			cout << t << " " << building << " " << p.x << " " << p.y << ";";
+			output << t << " " << building << " " << p.x << " " << p.y << ";";
 	}
 };
 
@@ -351,50 +823,7 @@ public:
 	char moves_unit1[GA_TURNS];
 	char moves_unit2[GA_TURNS];
 	double fitness;
-	Individual() {}
-	Individual(int fake_init)
-	{
-		for (int i = 0; i < GA_TURNS; i++)
-		{
-			moves_unit1[i] = moves[rand() % 5];
-			moves_unit2[i] = moves[rand() % 5];
-		}
-	}
-	Individual(const Position& pos1, const Position& pos2, char moves_unit1[GA_TURNS], char moves_unit2[GA_TURNS])
-	{
-		this->unit1_starting_position = pos1;
-		this->unit2_starting_position = pos2;
-		copy(moves_unit1, moves_unit1 + GA_TURNS, this->moves_unit1);
-		copy(moves_unit2, moves_unit2 + GA_TURNS, this->moves_unit2);
-		fitness = 0.0;
-	}
-	Individual mate(const Individual& par2, const Position& pos1, const Position& pos2)
-	{
-		char offspring_moves_unit1[GA_TURNS];
-		char offspring_moves_unit2[GA_TURNS];
-
-		for (int i = 0; i < GA_TURNS; ++i)
-		{
-			float p = (rand() % 100) / 100.0;
-			if (p < 0.4)
-			{
-				offspring_moves_unit1[i] = this->moves_unit1[i];
-				offspring_moves_unit2[i] = this->moves_unit2[i];
-			}
-			else if (p < 0.8)
-			{
-				offspring_moves_unit1[i] = par2.moves_unit1[i];
-				offspring_moves_unit2[i] = par2.moves_unit2[i];
-			}
-			else
-			{
-				offspring_moves_unit1[i] = moves[rand() % 5];
-				offspring_moves_unit2[i] = moves[rand() % 5];
-			}
-		}
-
-		return Individual(pos1, pos2, offspring_moves_unit1, offspring_moves_unit2);
-	}
+	Individual() : fitness(-DBL_MAX) {}
 
 	string print()
 	{
@@ -409,92 +838,705 @@ public:
 		return s;
 	}
 };
-bool operator<(const Individual &ind1, const Individual &ind2) { return ind1.fitness > ind2.fitness; }
 
-class Game
+// xorshift64*, one per GA thread instead of the shared rand()
+class XorShift
 {
 public:
-	int turn;
+	XorShift(uint64_t seed) : state(seed ? seed : 0x9E3779B97F4A7C15ull) {}
 
-	vector<shared_ptr<Unit>> units;
-	vector<shared_ptr<Building>> buildings;
-	vector<Position> mine_spots;
-	vector<Command> commands;
+	inline uint64_t next()
+	{
+		state ^= state >> 12;
+		state ^= state << 25;
+		state ^= state >> 27;
+		return state * 0x2545F4914F6CDD1Dull;
+	}
+	inline int below(int n) { return (int)(((next() >> 32) * (uint64_t)n) >> 32); }
 
-	Position center;
-	shared_ptr<Building> hq_ally;
-	shared_ptr<Building> hq_enemy;
+	uint64_t state;
+};
 
-	vector<shared_ptr<Unit>> units_in_order;
-	vector<shared_ptr<Unit>> units_ally;
-	vector<shared_ptr<Building>> buildings_ally;
+// GA genomes as structure of arrays: cells are Bitboard indices, genes are indices in moves
+class Population
+{
+public:
+	int unit1_start[GA_POPULATION_SIZE];
+	int unit2_start[GA_POPULATION_SIZE];
+	uint8_t moves_unit1[GA_TURNS][GA_POPULATION_SIZE];
+	uint8_t moves_unit2[GA_TURNS][GA_POPULATION_SIZE];
+	double fitness[GA_POPULATION_SIZE];
+};
 
-	vector<shared_ptr<Unit>> units_enemy;
-	vector<shared_ptr<Building>> buildings_enemy;
+// Turn 1 board data the GA threads read
+class GeneticContext
+{
+public:
+	vector<int> starts; // cells where unit1 can be trained
+	vector<vector<int>> spawnable; // cells where unit2 can be trained, for each start
+	int next_cell[width * height][5]; // cell reached by each move, moves into the border stay in place
+	Bitboard level_1_cells;
+	Bitboard visited; // ally cells, already counted
+	int hq_enemy;
+};
 
-	vector<Position> positions_ally;
-	vector<Position> positions_enemy;
+#ifdef RHEA_PLANNER
+// Board data the rolling horizon planner reads, built once per turn
+class PlannerContext
+{
+public:
+	vector<int> cells; // starting cell of each planned unit
+	vector<int> levels;
+	vector<int> targets; // objective of each unit, -1 if none
+	Bitboard enterable[4]; // by level, cells a unit can step on ignoring our own units
+	Bitboard occupied; // all our units
+	Bitboard owned;
+	double cell_value[width * height]; // gain for taking the cell
+	int hq_enemy;
+};
+#endif
 
-	int distances[width * height][width * height];
+// Cells within a path length of each cell, built once per map
+class Stencil
+{
+public:
+	vector<uint8_t> cells[width * height];
 
-	unordered_map<Position, vector<Position>, HashPosition> adjacency_list;
-	unordered_map<Position, vector<Position>, HashPosition> adjacency_list_position_enemy;
-	unordered_map<Position, vector<Position>, HashPosition> adjacency_list_position_enemy_for_cut;
-	unordered_map<Position, vector<Position>, HashPosition> adjacency_list_position_ally;
-	unordered_map<Position, vector<Position>, HashPosition> adjacency_list_position_ally_for_cut;
+	void build(const uint8_t distances[][width * height], int radius)
+	{
+		for (int source = 0; source < width * height; source++)
+		{
+			cells[source].clear();
+			for (int index = 0; index < width * height; index++)
+				if (distances[source][index] <= radius)
+					cells[source].push_back(index);
+		}
+	}
+};
 
-	vector<vector<Cell>> cells;
-	char cells_info[width][height]; // stores the chars representing the cell type
-	int cells_used_objective[width][height]; // used for objective
-	int cells_used_movement[width][height]; // used for movement
-	int cells_level_ally[width][height]; // level required to move to cell
-	int cells_level_enemy[width][height]; // level required to move to cell
+// Sums over the cells of the weights of sources within the radius of the stencil, kept up to date as sources come and go
+template <typename T>
+class InfluenceMap
+{
+public:
+	InfluenceMap(const Stencil& stencil) : stencil(stencil) { clear(); }
 
-	int gold_ally, income_ally;
-	int gold_enemy, income_enemy;
+	inline void clear() { fill(values, values + width * height, T()); }
+	inline void add(const Position& source, T weight)
+	{
+		for (uint8_t index : stencil.cells[Bitboard::index(source)])
+			values[index] += weight;
+	}
+	inline void remove(const Position& source, T weight) { add(source, -weight); }
+	inline T get(const Position& position) const { return values[Bitboard::index(position)]; }
+	inline vector<T> to_vector() const { return vector<T>(values, values + width * height); }
 
-	double score_enemy[width][height];
-	double cuts_ally[width][height];
-	double cuts_enemy[width][height];
-	int enemy_towers_around[width][height];
-	int ally_towers_around[width][height];
+private:
+	const Stencil& stencil;
+	T values[width * height];
+};
 
-	bool close_to_enemy;
-	pair<vector<Position>, vector<Position>> ga_best_paths;
-	bool use_ga;
-	shared_ptr<Unit> unit1;
-	shared_ptr<Unit> unit2;
+// What cutting a set of cells gains, by Zobrist hash of the set. Entries from before the last state change are stale.
+class CutTable
+{
+public:
+	class Entry
+	{
+	public:
+		uint64_t hash;
+		uint32_t version;
+		double gain;
+	};
 
-	// Utilities
-	inline Cell& get_cell(const Position& position) { return cells[position.y][position.x]; }
-	inline int get_cells_used_movement(const Position& position) { return cells_used_movement[position.y][position.x]; }
-	inline int get_cells_level_ally(const Position& position) { return cells_level_ally[position.y][position.x]; }
-	inline int get_cells_level_enemy(const Position& position) { return cells_level_enemy[position.y][position.x]; }
-	inline int get_cells_used_objective(const Position& position) { return cells_used_objective[position.y][position.x]; }
-	inline char get_cell_info(const Position& position) { return cells_info[position.y][position.x]; }
-	inline double get_cuts_ally(const Position& position) { return cuts_ally[position.y][position.x]; }
-	inline double get_cuts_enemy(const Position& position) { return cuts_enemy[position.y][position.x]; }
-	inline int get_enemy_towers_around(const Position& position) { return enemy_towers_around[position.y][position.x]; }
-	inline int get_ally_towers_around(const Position& position) { return ally_towers_around[position.y][position.x]; }
-	inline double get_score_enemy(const Position& position) { return score_enemy[position.y][position.x]; }
-	inline vector<Position>& get_adjacency_list(const Position& position) { return adjacency_list.at(position); }
-	inline vector<Position>& get_adjacency_list_position_enemy(const Position& position) { return adjacency_list_position_enemy.at(position); }
+	CutTable() : entries(CUT_TABLE_SIZE)
+	{
+		XorShift random(0x5DEECE66Dull);
+		for (int index = 0; index < width * height; index++)
+			for (int pov = 0; pov < 2; pov++)
+				keys[index][pov] = random.next();
+	}
 
-	inline bool can_train_level3() { return gold_ally >= 30 && income_ally >= 20; }
-	inline bool can_train_level2() { return gold_ally >= 20 && income_ally >= 4; }
-	inline bool can_train_level1() { return gold_ally >= 10 && income_ally >= 1; }
-	inline bool can_train_level(int level)
+	inline uint64_t key(const Position& position, bool my_pov) const { return keys[Bitboard::index(position)][my_pov]; }
+	inline uint64_t hash(const Bitboard& cells, bool my_pov) const
 	{
-		switch (level)
-		{
-		case 1:
-			return can_train_level1();
-			break;
-		case 2:
-			return can_train_level2();
-			break;
-		case 3:
-			return can_train_level3();
+		uint64_t hash = 0;
+		for (int index = 0; index < width * height; index++)
+			if (cells.bits.test(index))
+				hash ^= keys[index][my_pov];
+		return hash;
+	}
+	inline bool probe(uint64_t hash, double& gain) const
+	{
+		const Entry& entry = entries[hash & (CUT_TABLE_SIZE - 1)];
+		if (entry.version != version || entry.hash != hash)
+			return false;
+
+		gain = entry.gain;
+		return true;
+	}
+	inline void store(uint64_t hash, double gain) { entries[hash & (CUT_TABLE_SIZE - 1)] = { hash, version, gain }; }
+	inline void invalidate() { version++; }
+
+private:
+	uint64_t keys[width * height][2];
+	vector<Entry> entries;
+	uint32_t version = 1;
+};
+
+class CutSearchContext
+{
+public:
+	vector<Position> path; // chain grown in place
+	Bitboard on_path;
+	uint64_t hash; // of the cells on the path
+	bool my_pov;
+	Bitboard territory; // the side being cut
+	double gold; // to spend on the cut
+	double cost; // of the path, only grows as it is extended
+	double gain_bound; // the whole territory plus the path cells outside it
+	double outside_value; // most a cell outside the territory adds to the gain
+	double values[width * height]; // cut off by taking the cell alone
+	int nodes;
+	bool expired;
+	pair<double, vector<Position>> best;
+};
+
+// Cells a unit plans to be on in the coming turns, see plan_routes
+class Route
+{
+public:
+	int target;
+	vector<uint8_t> cells; // from the unit's cell this turn, ROUTE_TURNS + 1 at most
+};
+
+class LethalContext
+{
+public:
+	vector<shared_ptr<Unit>> units; // that can still move, at most 64
+	vector<Position> path; // chain to the enemy HQ
+	vector<int> levels; // needed to take each cell of the path
+	vector<int> movers; // unit stepping onto each cell of the path, -1 to train there
+	Bitboard on_path;
+	uint64_t used; // units stepping onto the path
+	int cost;
+	int weights[width * height]; // least gold a cell can be taken with
+	int remaining[width * height]; // least gold to take a cell and chain from it to the HQ
+	int nodes;
+	bool expired;
+	int best_cost;
+	vector<Position> best_path;
+	vector<int> best_levels;
+	vector<int> best_movers;
+};
+
+#ifdef RHEA_PLANNER
+// Cell reached from cell by moves[move], moves into the border stay in place
+inline int step_cell(int cell, int move)
+{
+	int x = cell % width;
+	switch (move)
+	{
+	case 0:
+		return cell >= width ? cell - width : cell;
+	case 1:
+		return cell < width * (height - 1) ? cell + width : cell;
+	case 2:
+		return x < width - 1 ? cell + 1 : cell;
+	case 3:
+		return x > 0 ? cell - 1 : cell;
+	default:
+		return cell;
+	}
+}
+#endif
+
+// Ice and Fire referee rules on a compact board, fast enough for look-ahead and offline self-play.
+// Players are 0 and 1, each plays its whole turn in apply_turn before the other one.
+class Simulation
+{
+public:
+	Bitboard passable;
+	Bitboard mine_spots;
+	Bitboard territory[2]; // owned cells, active or not
+	Bitboard active[2]; // owned cells connected to the HQ
+	Bitboard units[2];
+	Bitboard towers[2];
+	Bitboard mines[2];
+	Bitboard moved; // units that moved or were trained this turn
+	int unit_level[width * height];
+	int unit_id[width * height];
+	vector<int> unit_cell; // cell of each unit id, -1 once dead
+	Position hq[2];
+	int gold[2];
+	int upkeep[2];
+	int turn; // incremented once both players played
+	int winner; // -1 while nobody captured the other HQ
+
+	uint8_t distances[width * height][width * height];
+
+	inline static int cost_of_unit(int level) { return level == 1 ? level_1_cost : level == 2 ? level_2_cost : level_3_cost; }
+	inline static int upkeep_of_unit(int level) { return level == 1 ? level_1_upkeep : level == 2 ? level_2_upkeep : level_3_upkeep; }
+
+	void init(const vector<string>& map, const vector<Position>& mine_spots, const Position& hq_player0)
+	{
+		passable.clear();
+		for (int j = 0; j < height; j++)
+			for (int i = 0; i < width; i++)
+				if (map[j][i] != '#')
+					passable.set(Position(i, j));
+
+		this->mine_spots = Bitboard::from(mine_spots);
+		hq[0] = hq_player0;
+		hq[1] = Position(width - 1 - hq_player0.x, height - 1 - hq_player0.y);
+
+		for (int player = 0; player < 2; player++)
+		{
+			territory[player] = active[player] = Bitboard::from(hq[player]);
+			units[player].clear();
+			towers[player].clear();
+			mines[player].clear();
+			gold[player] = starting_gold;
+			upkeep[player] = 0;
+		}
+
+		moved.clear();
+		fill(unit_level, unit_level + width * height, 0);
+		fill(unit_id, unit_id + width * height, -1);
+		unit_cell.clear();
+		turn = 0;
+		winner = -1;
+
+		for (int source = 0; source < width * height; source++)
+			compute_distances_from(distances[source], source, passable);
+	}
+
+	inline int income(int player) const { return active[player].count() + mine_income * (mines[player] & active[player]).count() - upkeep[player]; }
+	inline int cost_of_mine(int player) const { return mine_cost + mine_cost_increment * mines[player].count(); }
+	inline bool is_building(int player, int index) const { return index == Bitboard::index(hq[player]) || towers[player].bits.test(index) || mines[player].bits.test(index); }
+	// Active towers protect themselves and the active cells around them
+	inline Bitboard protected_cells(int player) const { return (towers[player] & active[player]).dilate() & active[player]; }
+
+	bool can_enter(int player, int level, int index) const
+	{
+		int enemy = 1 - player;
+
+		if (!passable.bits.test(index) || units[player].bits.test(index) || is_building(player, index))
+			return false;
+
+		if (level < 3)
+		{
+			if (towers[enemy].bits.test(index) || protected_cells(enemy).bits.test(index))
+				return false;
+
+			if (units[enemy].bits.test(index) && unit_level[index] >= level)
+				return false;
+		}
+
+		return true;
+	}
+
+	void start_turn(int player)
+	{
+		moved.clear();
+		gold[player] += income(player);
+
+		// Bankrupt: upkeep cannot be paid and all units die
+		if (gold[player] < 0)
+		{
+			kill_units(player, units[player]);
+			gold[player] = 0;
+		}
+	}
+	bool apply(int player, const Command& command)
+	{
+		if (winner >= 0)
+			return false;
+
+		switch (command.t)
+		{
+		case MOVE:
+			return move(player, command.idOrLevel, command.p);
+		case TRAIN:
+			return train(player, command.idOrLevel, command.p);
+		case BUILD:
+			return build(player, command.building == "TOWER" ? TOWER : MINE, command.p);
+		default:
+			return false;
+		}
+	}
+	void apply_turn(int player, const vector<Command>& commands)
+	{
+		start_turn(player);
+
+		for (auto& command : commands)
+			apply(player, command);
+
+		if (player == 1)
+			turn++;
+	}
+
+	bool move(int player, int id, const Position& target)
+	{
+		if (id < 0 || id >= (int)unit_cell.size() || unit_cell[id] < 0)
+			return false;
+
+		int from = unit_cell[id];
+		int to = Bitboard::index(target);
+		if (!units[player].bits.test(from) || moved.bits.test(from) || from == to || to < 0 || to >= width * height)
+			return false;
+
+		// One step to the enterable neighbour closest to the target
+		int level = unit_level[from];
+		int best = -1;
+		int best_distance = distances[from][to];
+		int x = from % width;
+		int neighbours[4] = { from >= width ? from - width : -1, from < width * (height - 1) ? from + width : -1, x < width - 1 ? from + 1 : -1, x > 0 ? from - 1 : -1 };
+		for (int next : neighbours)
+			if (next >= 0 && distances[next][to] < best_distance && can_enter(player, level, next))
+			{
+				best = next;
+				best_distance = distances[next][to];
+			}
+
+		if (best < 0)
+			return false;
+
+		units[player].bits.reset(from);
+		unit_level[from] = 0;
+		unit_id[from] = -1;
+
+		occupy(player, best);
+		place_unit(player, id, level, best);
+		return true;
+	}
+	bool train(int player, int level, const Position& target)
+	{
+		if (level < 1 || level > 3 || gold[player] < cost_of_unit(level) || !passable.test(target))
+			return false;
+
+		int index = Bitboard::index(target);
+		if (!active[player].dilate().bits.test(index) || !can_enter(player, level, index))
+			return false;
+
+		gold[player] -= cost_of_unit(level);
+		upkeep[player] += upkeep_of_unit(level);
+
+		occupy(player, index);
+		unit_cell.push_back(index);
+		place_unit(player, (int)unit_cell.size() - 1, level, index);
+		return true;
+	}
+	bool build(int player, BuildingType type, const Position& target)
+	{
+		int index = Bitboard::index(target);
+		if (!active[player].bits.test(index) || units[0].bits.test(index) || units[1].bits.test(index) || is_building(0, index) || is_building(1, index))
+			return false;
+
+		if (type == TOWER)
+		{
+			if (mine_spots.bits.test(index) || gold[player] < tower_cost)
+				return false;
+
+			gold[player] -= tower_cost;
+			towers[player].bits.set(index);
+			return true;
+		}
+		else if (type == MINE)
+		{
+			if (!mine_spots.bits.test(index) || gold[player] < cost_of_mine(player))
+				return false;
+
+			gold[player] -= cost_of_mine(player);
+			mines[player].bits.set(index);
+			return true;
+		}
+
+		return false;
+	}
+
+	// Takes the cell for player: enemy units and buildings there are destroyed, capturing the HQ wins
+	void occupy(int player, int index)
+	{
+		int enemy = 1 - player;
+
+		if (units[enemy].bits.test(index))
+			kill_units(enemy, Bitboard::from(Bitboard::position(index)));
+
+		if (index == Bitboard::index(hq[enemy]))
+			winner = player;
+
+		towers[enemy].bits.reset(index);
+		mines[enemy].bits.reset(index);
+		territory[enemy].bits.reset(index);
+		territory[player].bits.set(index);
+
+		// Cells cut from their HQ go inactive and the units standing on them die
+		for (int p = 0; p < 2; p++)
+		{
+			active[p] = Bitboard::from(hq[p]).flood_fill(territory[p]);
+			if ((units[p] - active[p]).any())
+				kill_units(p, units[p] - active[p]);
+		}
+	}
+	void place_unit(int player, int id, int level, int index)
+	{
+		units[player].bits.set(index);
+		moved.bits.set(index);
+		unit_level[index] = level;
+		unit_id[index] = id;
+		unit_cell[id] = index;
+	}
+	void kill_units(int player, const Bitboard& cells)
+	{
+		for (int index = 0; index < width * height; index++)
+			if (cells.bits.test(index) && units[player].bits.test(index))
+			{
+				upkeep[player] -= upkeep_of_unit(unit_level[index]);
+				unit_cell[unit_id[index]] = -1;
+				units[player].bits.reset(index);
+				unit_level[index] = 0;
+				unit_id[index] = -1;
+			}
+	}
+
+	// Winner by HQ capture, otherwise whoever holds more active cells, -1 for a draw
+	int result() const
+	{
+		if (winner >= 0)
+			return winner;
+
+		if (active[0].count() != active[1].count())
+			return active[0].count() > active[1].count() ? 0 : 1;
+
+		return -1;
+	}
+
+	// Game input as the referee sends it, seen by player
+	string init_input() const
+	{
+		ostringstream input;
+		vector<Position> spots = mine_spots.to_positions();
+		input << spots.size() << "\n";
+		for (auto& spot : spots)
+			input << spot.x << " " << spot.y << "\n";
+		return input.str();
+	}
+	string turn_input(int player) const
+	{
+		int enemy = 1 - player;
+		ostringstream input;
+		input << gold[player] << "\n" << income(player) << "\n" << gold[enemy] << "\n" << income(enemy) << "\n";
+
+		for (int j = 0; j < height; j++)
+		{
+			for (int i = 0; i < width; i++)
+			{
+				int index = i + width * j;
+				if (!passable.bits.test(index))
+					input << '#';
+				else if (territory[player].bits.test(index))
+					input << (active[player].bits.test(index) ? 'O' : 'o');
+				else if (territory[enemy].bits.test(index))
+					input << (active[enemy].bits.test(index) ? 'X' : 'x');
+				else
+					input << '.';
+			}
+			input << "\n";
+		}
+
+		ostringstream buildings;
+		int building_count = 0;
+		for (int owner : { player, enemy })
+			for (int index = 0; index < width * height; index++)
+			{
+				int type = index == Bitboard::index(hq[owner]) ? HQ : mines[owner].bits.test(index) ? MINE : towers[owner].bits.test(index) ? TOWER : -1;
+				if (type >= 0 && territory[owner].bits.test(index))
+				{
+					buildings << (owner == player ? 0 : 1) << " " << type << " " << index % width << " " << index / width << "\n";
+					building_count++;
+				}
+			}
+		input << building_count << "\n" << buildings.str();
+
+		ostringstream units_input;
+		int unit_count = 0;
+		for (int id = 0; id < (int)unit_cell.size(); id++)
+			if (unit_cell[id] >= 0)
+			{
+				int index = unit_cell[id];
+				units_input << (units[player].bits.test(index) ? 0 : 1) << " " << id << " " << unit_level[index] << " " << index % width << " " << index / width << "\n";
+				unit_count++;
+			}
+		input << unit_count << "\n" << units_input.str();
+
+		return input.str();
+	}
+
+	// Commands as printed by Game::send_commands
+	static vector<Command> parse_commands(const string& line)
+	{
+		vector<Command> commands;
+		istringstream stream(line);
+		string command;
+		while (getline(stream, command, ';'))
+		{
+			istringstream tokens(command);
+			string type;
+			tokens >> type;
+
+			if (type == "MOVE" || type == "TRAIN")
+			{
+				int id_or_level, x, y;
+				if (tokens >> id_or_level >> x >> y)
+					commands.push_back(Command(type == "MOVE" ? MOVE : TRAIN, id_or_level, Position(x, y)));
+			}
+			else if (type == "BUILD")
+			{
+				string building;
+				int x, y;
+				if (tokens >> building >> x >> y)
+					commands.push_back(Command(BUILD, building, Position(x, y)));
+			}
+		}
+		return commands;
+	}
+};
+
+class Game
+{
+public:
+	int turn;
+
+	vector<shared_ptr<Unit>> units;
+	vector<shared_ptr<Building>> buildings;
+	vector<Position> mine_spots;
+	vector<Command> commands;
+
+	Position center;
+	shared_ptr<Building> hq_ally;
+	shared_ptr<Building> hq_enemy;
+
+	vector<shared_ptr<Unit>> units_in_order;
+	vector<shared_ptr<Unit>> units_ally;
+	vector<shared_ptr<Building>> buildings_ally;
+
+	vector<shared_ptr<Unit>> units_enemy;
+	vector<shared_ptr<Building>> buildings_enemy;
+
+	vector<Position> positions_ally;
+	vector<Position> positions_enemy;
+
+	uint8_t distances[width * height][width * height]; // path lengths avoiding void cells, unreachable_distance if none
+	Stencil stencils[4]; // by radius, from distances
+
+	Adjacency adjacency_list;
+	Adjacency adjacency_list_position_enemy;
+	Adjacency adjacency_list_position_enemy_for_cut;
+	Adjacency adjacency_list_position_ally;
+	Adjacency adjacency_list_position_ally_for_cut;
+	MaxFlow cut_flow;
+	CutTable cut_table; // shared by the searches for our cuts and the enemy's
+
+	vector<vector<Cell>> cells;
+	char cells_info[width][height]; // stores the chars representing the cell type
+	int cells_used_objective[width][height]; // used for objective
+	int cells_used_movement[width][height]; // used for movement
+	int path_fields[width * height][width * height]; // by target, see get_path_field
+	bool path_field_valid[width * height];
+	int cells_level_ally[width][height]; // level required to move to cell
+	int cells_level_enemy[width][height]; // level required to move to cell
+
+	int gold_ally, income_ally;
+	int gold_enemy, income_enemy;
+
+	InfluenceMap<double> score_enemy { stencils[3] }; // levels of the enemy units within 3
+	double cuts_ally[width][height];
+	double cuts_enemy[width][height];
+
+	// Scoring features of the cells by index, see compute_score_planes
+	double plane_enemy_unit[width * height];
+	double plane_enemy_building[width * height];
+	double plane_territory[width * height]; // weight of the cell's owner
+	double plane_cuts[width * height]; // bonus of the cuts, when the unit is next to the cell
+	double plane_base[width * height]; // minus the distance to the enemy HQ
+	double plane_bound[4][width * height]; // by unit level, -DBL_MAX where a unit of that level may not go, DBL_MAX elsewhere
+	double unit_scores[width * height]; // see get_scores
+	InfluenceMap<int> enemy_towers_around { stencils[1] }; // buildings, towers or not
+	InfluenceMap<int> ally_towers_around { stencils[1] };
+
+	// Bitboards, kept in sync with cells_info by update_gamestate
+	Bitboard board_ally_active;
+	Bitboard board_ally_inactive;
+	Bitboard board_enemy_active;
+	Bitboard board_enemy_inactive;
+	Bitboard board_neutral;
+	Bitboard board_void;
+	Bitboard board_passable;
+	Bitboard board_mine_spots;
+	Bitboard board_units_ally[4]; // indexed by level
+	Bitboard board_units_enemy[4];
+	Bitboard board_towers_ally;
+	Bitboard board_towers_enemy;
+	Bitboard board_mines_ally;
+	Bitboard board_mines_enemy;
+	Bitboard dirty_cells; // changed since the last gamestate update, see refresh_gamestate
+	int threat_cost[width * height]; // enemy chainkill to our HQ, see get_chainkill_threat
+	int threat_came_from[width * height];
+	Bitboard threat_region; // cells the threat depends on
+	Bitboard threat_dirty; // changed since the threat was computed
+	Bitboard threat_cells; // on the threat path when there is one, see assign_objective_to_units
+
+	TimeBudget budget;
+	double turn_time_first_ms;
+	double turn_time_ms;
+
+	istream& input; // referee input, cin unless playing in-process
+	ostream& output;
+
+	bool close_to_enemy;
+	pair<vector<Position>, vector<Position>> ga_best_paths;
+	bool use_ga;
+#ifdef RHEA_PLANNER
+	bool use_rhea; // plan moves with the rolling horizon planner instead of the routes
+	unordered_map<int, vector<uint8_t>> rhea_plan; // best plan of last turn by unit id, RHEA_TURNS moves each
+#endif
+	unordered_map<int, Route> routes; // by unit id, kept from turn to turn
+	Bitboard reserved[ROUTE_TURNS + 1]; // cells our routed units are on at each turn
+	shared_ptr<Unit> unit1;
+	shared_ptr<Unit> unit2;
+
+	Game(istream& input = cin, ostream& output = cout) : turn_time_first_ms(TURN_TIME_FIRST_MS), turn_time_ms(TURN_TIME_MS), input(input), output(output) {}
+
+	// Utilities
+	inline Cell& get_cell(const Position& position) { return cells[position.y][position.x]; }
+	inline int get_cells_used_movement(const Position& position) { return cells_used_movement[position.y][position.x]; }
+	inline int get_cells_level_ally(const Position& position) { return cells_level_ally[position.y][position.x]; }
+	inline int get_cells_level_enemy(const Position& position) { return cells_level_enemy[position.y][position.x]; }
+	inline int get_cells_used_objective(const Position& position) { return cells_used_objective[position.y][position.x]; }
+	inline char get_cell_info(const Position& position) { return cells_info[position.y][position.x]; }
+	inline double get_cuts_ally(const Position& position) { return cuts_ally[position.y][position.x]; }
+	inline double get_cuts_enemy(const Position& position) { return cuts_enemy[position.y][position.x]; }
+	inline int get_enemy_towers_around(const Position& position) { return enemy_towers_around.get(position); }
+	inline int get_ally_towers_around(const Position& position) { return ally_towers_around.get(position); }
+	inline double get_score_enemy(const Position& position) { return score_enemy.get(position); }
+	inline Adjacency::Range get_adjacency_list(const Position& position) { return adjacency_list[position]; }
+	inline Adjacency::Range get_adjacency_list_position_enemy(const Position& position) { return adjacency_list_position_enemy[position]; }
+
+	inline bool can_train_level3() { return gold_ally >= 30 && income_ally >= 20; }
+	inline bool can_train_level2() { return gold_ally >= 20 && income_ally >= 4; }
+	inline bool can_train_level1() { return gold_ally >= 10 && income_ally >= 1; }
+	inline bool can_train_level(int level)
+	{
+		switch (level)
+		{
+		case 1:
+			return can_train_level1();
+			break;
+		case 2:
+			return can_train_level2();
+			break;
+		case 3:
+			return can_train_level3();
 			break;
 		default:
 			return false;
@@ -537,31 +1579,9 @@ public:
 			break;
 		}
 	}
-	inline int nbr_units_ally_of_level(int level)
-	{
-		int n = 0;
-		for (auto& unit : units_ally)
-			if (unit->level == level)
-				n++;
-
-		return n;
-	}
-	inline int nbr_mines_ally()
-	{
-		int n = 0;
-		for (auto& building : buildings_ally)
-			if (building->owner == 0 && building->t == BuildingType::MINE)
-				n++;
-		return n;
-	}
-	inline int nbr_towers_ally()
-	{
-		int n = 0;
-		for (auto& building : buildings_ally)
-			if (building->owner == 0 && building->t == BuildingType::TOWER)
-				n++;
-		return n;
-	}
+	inline int nbr_units_ally_of_level(int level) { return board_units_ally[level].count(); }
+	inline int nbr_mines_ally() { return board_mines_ally.count(); }
+	inline int nbr_towers_ally() { return board_towers_ally.count(); }
 	inline shared_ptr<Building> getHQ()
 	{
 		for (auto& b : buildings)
@@ -574,101 +1594,55 @@ public:
 			if (b->isHQ() && !b->isOwned())
 				return b;
 	}
-	inline bool is_position_attainable(const Position& position)
+	inline bool is_position_attainable(const Position& position) { return board_ally_active.dilate().test(position); }
+	inline void refresh_gamestate_for_movement(shared_ptr<Unit> unit, const Position& destination)
 	{
-		if (get_cell_info(Position(position.x, position.y)) == 'O')
-			return true;
-
-		if (get_cell_info(Position(position.x, min(position.y + 1, width - 1))) == 'O')
-			return true;
-
-		if (get_cell_info(Position(position.x, max(position.y - 1, 0))) == 'O')
-			return true;
-
-		if (get_cell_info(Position(min(position.x + 1, height - 1), position.y)) == 'O')
-			return true;
-
-		if (get_cell_info(Position(max(position.x - 1, 0), position.y)) == 'O')
-			return true;
-
-		return false;
+		record_movement(unit, destination);
+		refresh_gamestate();
 	}
-	inline void refresh_gamestate_for_movement(shared_ptr<Unit> unit, const Position& destination)
+	// The changes of a move, for refresh_gamestate to take into account
+	inline void record_movement(shared_ptr<Unit> unit, const Position& destination)
 	{
-		cells_used_movement[destination.y][destination.x] = 1;
+		use_cell_for_movement(destination);
 		income_ally += (cells_info[destination.y][destination.x] != 'O');
 		cells_info[destination.y][destination.x] = 'O';
+		dirty_cells.set(unit->p);
+		dirty_cells.set(destination);
 		unit->p = destination;
-		update_gamestate();
 	}
 	inline void refresh_gamestate_for_spawn(shared_ptr<Unit> unit, const Position& destination)
 	{
-		cells_used_movement[destination.y][destination.x] = 1;
+		use_cell_for_movement(destination);
 		income_ally += (cells_info[destination.y][destination.x] != 'O');
 		gold_ally -= cost_of_unit(unit->level);
 		income_ally -= upkeep_of_unit(unit->level);
 		cells_info[destination.y][destination.x] = 'O';
+		dirty_cells.set(destination);
 		units.push_back(unit);
-		update_gamestate();
+		refresh_gamestate();
 	}
 	inline void refresh_gamestate_for_building(shared_ptr<Building> building)
 	{
 		income_ally += 4 * (building->t == BuildingType::MINE);
 		gold_ally -= tower_cost * (building->t == BuildingType::TOWER);
+		dirty_cells.set(building->p);
 		buildings.push_back(building);
-		update_gamestate();
-	}
-	inline int get_distance(const Position& pos1, const Position& pos2) { return distances[pos1.x + height * pos1.y][pos2.x + height * pos2.y]; }
-	inline vector<Position> get_frontier_ally(int distance)
-	{
-		vector<Position> frontier;
-		for (auto& position_ally : positions_ally)
-			for (auto& position_enemy : positions_enemy)
-				if (get_distance(position_ally, position_enemy) <= distance)
-				{
-					frontier.push_back(position_ally);
-					break;
-				}
-		return frontier;
-	}
-	inline vector<Position> get_frontier_enemy(int distance)
-	{
-		vector<Position> frontier;
-		for (auto& position_enemy : positions_enemy)
-			for (auto& position_ally : positions_ally)
-				if (get_distance(position_ally, position_enemy) <= distance)
-				{
-					frontier.push_back(position_enemy);
-					break;
-				}
-		return frontier;
+		refresh_gamestate();
 	}
+	inline int get_distance(const Position& pos1, const Position& pos2) { return distances[Bitboard::index(pos1)][Bitboard::index(pos2)]; }
+	inline vector<Position> get_frontier_ally(int distance) { return (board_ally_active & board_enemy_active.dilate(distance, board_passable)).to_positions(); }
+	inline vector<Position> get_frontier_enemy(int distance) { return (board_enemy_active & board_ally_active.dilate(distance, board_passable)).to_positions(); }
 	inline vector<Position> get_frontier_spawn_ally(int distance)
 	{
-		vector<Position> frontier;
-		for (int i = 0; i < width; i++)
-			for (int j = 0; j < height; j++)
-				for (auto& position_ally : positions_ally)
-					if (get_distance(Position(i, j), position_ally) == distance && (get_cell_info(Position(i, j)) == '.' || get_cell_info(Position(i, j)) == 'X' || get_cell_info(Position(i, j)) == 'x'))
-					{
-						frontier.push_back(Position(i, j));
-						break;
-					}
-		return frontier;
+		Bitboard ring = board_ally_active.dilate(distance, board_passable) - board_ally_active.dilate(distance - 1, board_passable);
+		return (ring & (board_neutral | board_enemy_active | board_enemy_inactive)).to_positions();
 	}
 	inline vector<Position> get_frontier_spawn_enemy(int distance)
 	{
-		vector<Position> frontier;
-		for (int i = 0; i < width; i++)
-			for (int j = 0; j < height; j++)
-				for (auto& position_enemy : positions_enemy)
-					if (get_distance(Position(i, j), position_enemy) == distance && (get_cell_info(Position(i, j)) == '.' || get_cell_info(Position(i, j)) == 'O' || get_cell_info(Position(i, j)) == 'o'))
-					{
-						frontier.push_back(Position(i, j));
-						break;
-					}
-		return frontier;
+		Bitboard ring = board_enemy_active.dilate(distance, board_passable) - board_enemy_active.dilate(distance - 1, board_passable);
+		return (ring & (board_neutral | board_ally_active | board_ally_inactive)).to_positions();
 	}
+	inline bool is_close_to_enemy(int distance) { return (board_ally_active & board_enemy_active.dilate(distance, board_passable)).any(); }
 
 
 	// Main functions
@@ -683,21 +1657,26 @@ public:
 	void init()
 	{
 		int numberMineSpots;
-		cin >> numberMineSpots;
-		cin.ignore();
+		input >> numberMineSpots;
+		input.ignore();
 		for (int i = 0; i < numberMineSpots; i++)
 		{
 			int x;
 			int y;
-			cin >> x >> y; cin.ignore();
+			input >> x >> y; input.ignore();
 			mine_spots.push_back(Position(x, y));
 		}
+		board_mine_spots = Bitboard::from(mine_spots);
 
 		center = Position(5, 5);
 		turn = 0;
 		use_ga = true;
+#ifdef RHEA_PLANNER
+		use_rhea = true;
+#endif
 	}
-	void update_game()
+	// Returns false once the input is exhausted, which only happens when replaying a recording
+	bool update_game()
 	{
 		Stopwatch s("Update game");
 
@@ -708,37 +1687,40 @@ public:
 		buildings.clear();
 		commands.clear();
 
-		cin >> gold_ally; cin.ignore();
-		cin >> income_ally; cin.ignore();
+		input >> gold_ally; input.ignore();
+		if (!input)
+			return false;
+		budget.start_turn((turn <= 1 ? turn_time_first_ms : turn_time_ms) - TURN_TIME_MARGIN_MS);
+		input >> income_ally; input.ignore();
 
-		cin >> gold_enemy; cin.ignore();
-		cin >> income_enemy; cin.ignore();
+		input >> gold_enemy; input.ignore();
+		input >> income_enemy; input.ignore();
 
 		cerr << "Gold: " << gold_ally << endl;
 
 		for (int i = 0; i < 12; i++)
 		{
 			string line;
-			cin >> line; cin.ignore();
+			input >> line; input.ignore();
 			for (int j = 0; j < line.size(); j++)
 				cells_info[i][j] = line[j];
 			cerr << line << endl;
 		}
 
 		int buildingCount;
-		cin >> buildingCount; cin.ignore();
+		input >> buildingCount; input.ignore();
 		for (int i = 0; i < buildingCount; i++)
 		{
 			int owner;
 			int buildingType;
 			int x;
 			int y;
-			cin >> owner >> buildingType >> x >> y; cin.ignore();
+			input >> owner >> buildingType >> x >> y; input.ignore();
 			buildings.push_back(make_shared<Building>(Building(x, y, buildingType, owner)));
 		}
 
 		int unitCount;
-		cin >> unitCount; cin.ignore();
+		input >> unitCount; input.ignore();
 		for (int i = 0; i < unitCount; i++)
 		{
 			int owner;
@@ -746,85 +1728,264 @@ public:
 			int level;
 			int x;
 			int y;
-			cin >> owner >> unitId >> level >> x >> y; cin.ignore();
+			input >> owner >> unitId >> level >> x >> y; input.ignore();
 			units.push_back(make_shared<Unit>(Unit(x, y, unitId, level, owner)));
 		}
 
 		for (int i = 0; i < width; i++)
 			for (int j = 0; j < height; j++)
 				cells_used_objective[j][i] = cells_used_movement[j][i] = 0;
+		fill(path_field_valid, path_field_valid + width * height, false);
 
 		if (turn <= 1)
 		{
 			hq_ally = getHQ();
 			hq_enemy = getOpponentHQ();
-			floyd_warshall();
+			update_territory_bitboards();
+			compute_distances(board_passable);
 		}
 
-		close_to_enemy = false;
-		for (auto& position_ally : positions_ally)
-			for (auto& position_enemy : positions_enemy)
-				if (get_distance(position_ally, position_enemy) <= 2)
-					close_to_enemy = true;
+		close_to_enemy = is_close_to_enemy(2);
+		return true;
 	}
 	void update_gamestate()
 	{
-		compute_adjacency_list_enemy();
+		update_territory();
+
+		// Cells
+		cells.clear();
+		cells = vector<vector<Cell>>(width, vector<Cell>(height));
 
 		for (int i = 0; i < width; i++)
 			for (int j = 0; j < height; j++)
-				if (cells_info[j][i] == 'X' && !find_path_to_destination(Position(i, j), hq_enemy->p))
-				{
-					cells_info[j][i] = 'x';
-					cerr << "Inactivating cell " << Position(i, j).print() << endl;
-				}
+				reset_cell(Position(i, j));
+
+		update_entities(~Bitboard());
+
+
+		// Level required to move to cell and adjacency lists
+		for (int i = 0; i < width; i++)
+			for (int j = 0; j < height; j++)
+			{
+				compute_cells_level(Position(i, j));
+				compute_adjacency(Position(i, j));
+			}
+
+
+		// Positions
+		positions_ally = board_ally_active.to_positions();
+		positions_enemy = board_enemy_active.to_positions();
+
+
+		// Scores
+		score_enemy.clear();
+		for (auto& enemy : units_enemy)
+			score_enemy.add(enemy->p, enemy->level);
+
+
+		// Towers around
+		enemy_towers_around.clear();
+		for (auto& building : buildings_enemy)
+			enemy_towers_around.add(building->p, 1);
+
+		ally_towers_around.clear();
+		for (auto& building : buildings_ally)
+			ally_towers_around.add(building->p, 1);
+
+		dirty_cells.clear();
+		cut_table.invalidate();
+		threat_dirty = threat_region = ~Bitboard();
+	}
+	// Same result as update_gamestate, but only recomputes what depends on the cells marked dirty since the last update
+	void refresh_gamestate()
+	{
+		vector<shared_ptr<Unit>> previous_units_enemy = units_enemy;
+		vector<shared_ptr<Building>> previous_buildings_ally = buildings_ally;
+		vector<shared_ptr<Building>> previous_buildings_enemy = buildings_enemy;
+		Bitboard previous_mines_ally = board_mines_ally;
+
+		dirty_cells |= update_territory();
+
+		// Cells
+		for (auto& position : dirty_cells.to_positions())
+			reset_cell(position);
 
-		bool repeat = true;
-		while (repeat)
+		update_entities(dirty_cells);
+
+
+		// Levels and adjacency also depend on the neighbours' territory and towers
+		for (auto& position : dirty_cells.dilate().to_positions())
 		{
-			repeat = false;
-			for (int i = 0; i < width; i++)
-				for (int j = 0; j < height; j++)
-					if (cells_info[j][i] == 'o')
-						if (cells_info[min(j + 1, width)][i] == 'O' || cells_info[max(j - 1, 0)][i] == 'O' || cells_info[j][min(i + 1, height)] == 'O' || cells_info[j][max(i - 1, 0)] == 'O')
-						{
-							cells_info[j][i] = 'O';
-							cerr << "Reactivating cell " << Position(i, j).print() << endl;
-							repeat = true;
-						}
+			compute_cells_level(position);
+			compute_adjacency(position);
 		}
 
 
-		// Cells
-		cells.clear();
-		cells = vector<vector<Cell>>(width, vector<Cell>(height));
+		// Positions
+		positions_ally = board_ally_active.to_positions();
+		positions_enemy = board_enemy_active.to_positions();
 
-		for (int i = 0; i < width; i++)
+
+		// Enemy units and buildings do not move during our turn, they can only be captured or cut off
+		for (auto& enemy : previous_units_enemy)
+			if (find(units_enemy.begin(), units_enemy.end(), enemy) == units_enemy.end())
+				score_enemy.remove(enemy->p, enemy->level);
+		for (auto& enemy : units_enemy)
+			if (find(previous_units_enemy.begin(), previous_units_enemy.end(), enemy) == previous_units_enemy.end())
+				score_enemy.add(enemy->p, enemy->level);
+
+		for (auto& building : previous_buildings_enemy)
+			if (find(buildings_enemy.begin(), buildings_enemy.end(), building) == buildings_enemy.end())
+				enemy_towers_around.remove(building->p, 1);
+		for (auto& building : buildings_enemy)
+			if (find(previous_buildings_enemy.begin(), previous_buildings_enemy.end(), building) == previous_buildings_enemy.end())
+				enemy_towers_around.add(building->p, 1);
+
+		for (auto& building : previous_buildings_ally)
+			if (find(buildings_ally.begin(), buildings_ally.end(), building) == buildings_ally.end())
+				ally_towers_around.remove(building->p, 1);
+		for (auto& building : buildings_ally)
+			if (find(previous_buildings_ally.begin(), previous_buildings_ally.end(), building) == previous_buildings_ally.end())
+				ally_towers_around.add(building->p, 1);
+
+		// Our mines cannot be walked on, the paths change with them
+		if (board_mines_ally != previous_mines_ally)
+			fill(path_field_valid, path_field_valid + width * height, false);
+
+		threat_dirty |= dirty_cells.dilate();
+		dirty_cells.clear();
+		cut_table.invalidate();
+
+#ifdef DEBUG_GAMESTATE
+		check_gamestate();
+#endif
+	}
+	// Rebuilds everything from scratch and asserts the incremental refresh got the same state
+	void check_gamestate()
+	{
+		auto flat = [](auto& grid) { return vector<decay_t<decltype(grid[0][0])>>(&grid[0][0], &grid[0][0] + width * height); };
+		auto same_cells = [](const vector<vector<Cell>>& lhs, const vector<vector<Cell>>& rhs)
+		{
 			for (int j = 0; j < height; j++)
-			{
-				cells[j][i] = Cell(i, j);
+				for (int i = 0; i < width; i++)
+					if (lhs[j][i].unit != rhs[j][i].unit || lhs[j][i].building != rhs[j][i].building || lhs[j][i].void_cell != rhs[j][i].void_cell || lhs[j][i].mine != rhs[j][i].mine)
+						return false;
+			return true;
+		};
+
+		vector<vector<Cell>> incremental_cells = cells;
+		auto incremental_level_ally = flat(cells_level_ally);
+		auto incremental_level_enemy = flat(cells_level_enemy);
+		auto incremental_score_enemy = score_enemy.to_vector();
+		auto incremental_enemy_towers_around = enemy_towers_around.to_vector();
+		auto incremental_ally_towers_around = ally_towers_around.to_vector();
+		auto incremental_adjacency_list = adjacency_list;
+		auto incremental_adjacency_list_enemy = adjacency_list_position_enemy;
+		auto incremental_adjacency_list_ally = adjacency_list_position_ally;
+		auto incremental_units_ally = units_ally;
+		auto incremental_units_enemy = units_enemy;
+		auto incremental_buildings_ally = buildings_ally;
+		auto incremental_buildings_enemy = buildings_enemy;
+		auto incremental_positions_ally = positions_ally;
+		auto incremental_positions_enemy = positions_enemy;
 
-				if (cells_info[j][i] == '#')
-					cells[j][i].set_void_cell();
-			}
+		update_gamestate();
+
+		bool same =
+			same_cells(incremental_cells, cells) &&
+			incremental_level_ally == flat(cells_level_ally) &&
+			incremental_level_enemy == flat(cells_level_enemy) &&
+			incremental_score_enemy == score_enemy.to_vector() &&
+			incremental_enemy_towers_around == enemy_towers_around.to_vector() &&
+			incremental_ally_towers_around == ally_towers_around.to_vector() &&
+			incremental_adjacency_list == adjacency_list &&
+			incremental_adjacency_list_enemy == adjacency_list_position_enemy &&
+			incremental_adjacency_list_ally == adjacency_list_position_ally &&
+			incremental_units_ally == units_ally &&
+			incremental_units_enemy == units_enemy &&
+			incremental_buildings_ally == buildings_ally &&
+			incremental_buildings_enemy == buildings_enemy &&
+			incremental_positions_ally == positions_ally &&
+			incremental_positions_enemy == positions_enemy;
+
+		if (!same)
+			cerr << "Incremental gamestate differs from full rebuild" << endl;
+		assert(same);
+	}
+	// Inactivates enemy cells cut from their HQ and reactivates ours reconnected to active territory,
+	// returns the cells whose territory changed since the bitboards were last computed
+	Bitboard update_territory()
+	{
+		Bitboard previous_ally_active = board_ally_active;
+		Bitboard previous_ally_inactive = board_ally_inactive;
+		Bitboard previous_enemy_active = board_enemy_active;
+		Bitboard previous_enemy_inactive = board_enemy_inactive;
+
+		update_territory_bitboards();
 
+		Bitboard enemy_connected = Bitboard::from(hq_enemy->p).flood_fill(board_enemy_active);
+		for (auto& position : (board_enemy_active - enemy_connected).to_positions())
+		{
+			cells_info[position.y][position.x] = 'x';
+			cerr << "Inactivating cell " << position.print() << endl;
+		}
+
+		Bitboard ally_connected = board_ally_active.flood_fill(board_ally_active | board_ally_inactive);
+		for (auto& position : (ally_connected & board_ally_inactive).to_positions())
+		{
+			cells_info[position.y][position.x] = 'O';
+			cerr << "Reactivating cell " << position.print() << endl;
+		}
 
+		update_territory_bitboards();
+
+		return
+			(board_ally_active ^ previous_ally_active) |
+			(board_ally_inactive ^ previous_ally_inactive) |
+			(board_enemy_active ^ previous_enemy_active) |
+			(board_enemy_inactive ^ previous_enemy_inactive);
+	}
+	inline void reset_cell(const Position& position)
+	{
+		Cell& cell = cells[position.y][position.x];
+		cell = Cell(position.x, position.y);
+
+		if (board_void.test(position))
+			cell.set_void_cell();
+
+		if (board_mine_spots.test(position))
+			cell.set_mine();
+	}
+	// Rebuilds the unit and building lists, only placing them in cells that are in placed
+	void update_entities(const Bitboard& placed)
+	{
 		// Units
 		units_ally.clear();
 		units_ally.reserve(units.size());
 		units_enemy.clear();
 		units_enemy.reserve(units.size());
+		for (int level = 0; level < 4; level++)
+		{
+			board_units_ally[level].clear();
+			board_units_enemy[level].clear();
+		}
 		for (auto& unit : units)
 		{
 			if (unit->isOwned())
 			{
 				units_ally.push_back(unit);
-				cells[unit->p.y][unit->p.x].set_unit(unit);
+				board_units_ally[unit->level].set(unit->p);
+
+				if (placed.test(unit->p))
+					cells[unit->p.y][unit->p.x].set_unit(unit);
 			}
 			else if (get_cell_info(unit->p) == 'X')
 			{
 				units_enemy.push_back(unit);
-				cells[unit->p.y][unit->p.x].set_unit(unit);
+				board_units_enemy[unit->level].set(unit->p);
+
+				if (placed.test(unit->p))
+					cells[unit->p.y][unit->p.x].set_unit(unit);
 			}
 		}
 
@@ -833,212 +1994,173 @@ public:
 		buildings_ally.reserve(buildings.size());
 		buildings_enemy.clear();
 		buildings_enemy.reserve(buildings.size());
+		board_towers_ally.clear();
+		board_towers_enemy.clear();
+		board_mines_ally.clear();
+		board_mines_enemy.clear();
 		for (auto& building : buildings)
 		{
 			if (building->isOwned())
 			{
 				buildings_ally.push_back(building);
-				cells[building->p.y][building->p.x].set_building(building);
-			}
-			else if (get_cell_info(building->p) == 'X' || get_cell_info(building->p) == 'x')
-			{
-				buildings_enemy.push_back(building);
-				cells[building->p.y][building->p.x].set_building(building);
-			}
-		}
-
-
-		// Mines
-		for (auto& mine : mine_spots)
-			cells[mine.y][mine.x].set_mine();
 
+				if (placed.test(building->p))
+					cells[building->p.y][building->p.x].set_building(building);
 
-		// Level required to move to cell
-		for (auto& row : cells)
-			for (auto& cell : row)
-			{
-				// Ally
-				if (cell.is_occupied_by_ally_hq())
-					cells_level_ally[cell.position.y][cell.position.x] = 9;
-				else if (cell.is_occupied_by_enemy_hq())
-					cells_level_ally[cell.position.y][cell.position.x] = 1;
-				else if (cell.is_occupied_by_enemy_mine())
-					cells_level_ally[cell.position.y][cell.position.x] = 1;
-				else if (cell.is_occupied_by_ally_mine())
-					cells_level_ally[cell.position.y][cell.position.x] = 9;
-				else if (cell.is_occupied_by_ally_tower())
-					cells_level_ally[cell.position.y][cell.position.x] = 9;
-				else if (cell.is_occupied_by_enemy_unit())
-					cells_level_ally[cell.position.y][cell.position.x] = min(3, cell.level_of_enemy_unit() + 1);
-				else if (cell.is_occupied_by_ally_unit())
-					cells_level_ally[cell.position.y][cell.position.x] = 9;
-				else if (cell.void_cell)
-					cells_level_ally[cell.position.y][cell.position.x] = 9;
-				else
-					cells_level_ally[cell.position.y][cell.position.x] = 1;
-
-				// Enemy
-				if (cell.is_occupied_by_enemy_hq())
-					cells_level_enemy[cell.position.y][cell.position.x] = 9;
-				else if (cell.is_occupied_by_ally_hq())
-					cells_level_enemy[cell.position.y][cell.position.x] = 1;
-				else if (cell.is_occupied_by_ally_mine())
-					cells_level_enemy[cell.position.y][cell.position.x] = 1;
-				else if (cell.is_occupied_by_enemy_mine())
-					cells_level_enemy[cell.position.y][cell.position.x] = 9;
-				else if (cell.is_occupied_by_enemy_tower())
-					cells_level_enemy[cell.position.y][cell.position.x] = 9;
-				else if (cell.is_occupied_by_ally_unit())
-					cells_level_enemy[cell.position.y][cell.position.x] = min(3, cell.level_of_ally_unit() + 1);
-				else if (cell.is_occupied_by_enemy_unit())
-					cells_level_enemy[cell.position.y][cell.position.x] = 9;
-				else if (cell.void_cell)
-					cells_level_enemy[cell.position.y][cell.position.x] = 9;
-				else
-					cells_level_enemy[cell.position.y][cell.position.x] = 1;
+				if (building->t == BuildingType::TOWER)
+					board_towers_ally.set(building->p);
+				else if (building->t == BuildingType::MINE)
+					board_mines_ally.set(building->p);
 			}
-
-		for (auto& row : cells)
-			for (auto& cell : row)
-				if (cell.is_occupied_by_enemy_tower())
-				{
-					cells_level_ally[cell.position.y][cell.position.x] = 3;
-
-					if (get_cell_info(Position(cell.position.x, min(cell.position.y + 1, width - 1))) == 'X')
-						cells_level_ally[min(cell.position.y + 1, width - 1)][cell.position.x] = 3;
-
-					if (get_cell_info(Position(cell.position.x, max(cell.position.y - 1, 0))) == 'X')
-						cells_level_ally[max(cell.position.y - 1, 0)][cell.position.x] = 3;
-
-					if (get_cell_info(Position(min(cell.position.x + 1, height - 1), cell.position.y)) == 'X')
-						cells_level_ally[cell.position.y][min(cell.position.x + 1, height - 1)] = 3;
-
-					if (get_cell_info(Position(max(cell.position.x - 1, 0), cell.position.y)) == 'X')
-						cells_level_ally[cell.position.y][max(cell.position.x - 1, 0)] = 3;
-				}
-
-		for (auto& row : cells)
-			for (auto& cell : row)
-				if (cell.is_occupied_by_ally_tower())
-				{
-					cells_level_enemy[cell.position.y][cell.position.x] = 3;
-
-					if (get_cell_info(Position(cell.position.x, min(cell.position.y + 1, width - 1))) == 'O')
-						cells_level_enemy[min(cell.position.y + 1, width - 1)][cell.position.x] = 3;
-
-					if (get_cell_info(Position(cell.position.x, max(cell.position.y - 1, 0))) == 'O')
-						cells_level_enemy[max(cell.position.y - 1, 0)][cell.position.x] = 3;
-
-					if (get_cell_info(Position(min(cell.position.x + 1, height - 1), cell.position.y)) == 'O')
-						cells_level_enemy[cell.position.y][min(cell.position.x + 1, height - 1)] = 3;
-
-					if (get_cell_info(Position(max(cell.position.x - 1, 0), cell.position.y)) == 'O')
-						cells_level_enemy[cell.position.y][max(cell.position.x - 1, 0)] = 3;
-				}
-
-
-		// Adjacency list
-		adjacency_list.clear();
-		for (auto& row : cells)
-			for (auto& cell : row)
+			else if (get_cell_info(building->p) == 'X' || get_cell_info(building->p) == 'x')
 			{
-				vector<Position> positions;
-
-				Position north_position = cell.position.north_position();
-				if (!get_cell(north_position).is_occupied_by_inacessible_building() && !get_cell(north_position).void_cell && north_position != cell.position)
-					positions.push_back(north_position);
-
-				Position south_position = cell.position.south_position();
-				if (!get_cell(south_position).is_occupied_by_inacessible_building() && !get_cell(south_position).void_cell && south_position != cell.position)
-					positions.push_back(south_position);
-
-				Position east_position = cell.position.east_position();
-				if (!get_cell(east_position).is_occupied_by_inacessible_building() && !get_cell(east_position).void_cell && east_position != cell.position)
-					positions.push_back(east_position);
-
-				Position west_position = cell.position.west_position();
-				if (!get_cell(west_position).is_occupied_by_inacessible_building() && !get_cell(west_position).void_cell && west_position != cell.position)
-					positions.push_back(west_position);
-
-				adjacency_list[cell.position] = positions;
-			}
-		compute_adjacency_list_enemy();
-		compute_adjacency_list_ally();
+				buildings_enemy.push_back(building);
 
+				if (placed.test(building->p))
+					cells[building->p.y][building->p.x].set_building(building);
 
-		// Positions
-		positions_ally.clear();
-		positions_enemy.clear();
-		for (int i = 0; i < width; i++)
-			for (int j = 0; j < height; j++)
-			{
-				if (cells_info[j][i] == 'X')
-					positions_enemy.push_back(Position(i, j));
-				else if (cells_info[j][i] == 'O')
-					positions_ally.push_back(Position(i, j));
+				if (building->t == BuildingType::TOWER)
+					board_towers_enemy.set(building->p);
+				else if (building->t == BuildingType::MINE)
+					board_mines_enemy.set(building->p);
 			}
+		}
+	}
+	void compute_cells_level(const Position& position)
+	{
+		Cell& cell = get_cell(position);
+		int& level_ally = cells_level_ally[position.y][position.x];
+		int& level_enemy = cells_level_enemy[position.y][position.x];
+
+		// Ally
+		if (cell.is_occupied_by_ally_hq())
+			level_ally = 9;
+		else if (cell.is_occupied_by_enemy_hq())
+			level_ally = 1;
+		else if (cell.is_occupied_by_enemy_mine())
+			level_ally = 1;
+		else if (cell.is_occupied_by_ally_mine())
+			level_ally = 9;
+		else if (cell.is_occupied_by_ally_tower())
+			level_ally = 9;
+		else if (cell.is_occupied_by_enemy_unit())
+			level_ally = min(3, cell.level_of_enemy_unit() + 1);
+		else if (cell.is_occupied_by_ally_unit())
+			level_ally = 9;
+		else if (cell.void_cell)
+			level_ally = 9;
+		else
+			level_ally = 1;
+
+		// Enemy
+		if (cell.is_occupied_by_enemy_hq())
+			level_enemy = 9;
+		else if (cell.is_occupied_by_ally_hq())
+			level_enemy = 1;
+		else if (cell.is_occupied_by_ally_mine())
+			level_enemy = 1;
+		else if (cell.is_occupied_by_enemy_mine())
+			level_enemy = 9;
+		else if (cell.is_occupied_by_enemy_tower())
+			level_enemy = 9;
+		else if (cell.is_occupied_by_ally_unit())
+			level_enemy = min(3, cell.level_of_ally_unit() + 1);
+		else if (cell.is_occupied_by_enemy_unit())
+			level_enemy = 9;
+		else if (cell.void_cell)
+			level_enemy = 9;
+		else
+			level_enemy = 1;
+
+		// Towers protect themselves and the active cells around them
+		Position neighbours[4] = { position.north_position(), position.south_position(), position.east_position(), position.west_position() };
+
+		if (cell.is_occupied_by_enemy_tower())
+			level_ally = 3;
+		else if (get_cell_info(position) == 'X')
+			for (auto& neighbour : neighbours)
+				if (get_cell(neighbour).is_occupied_by_enemy_tower())
+					level_ally = 3;
+
+		if (cell.is_occupied_by_ally_tower())
+			level_enemy = 3;
+		else if (get_cell_info(position) == 'O')
+			for (auto& neighbour : neighbours)
+				if (get_cell(neighbour).is_occupied_by_ally_tower())
+					level_enemy = 3;
+	}
+	void compute_adjacency(const Position& position)
+	{
+		adjacency_list.clear(position);
 
+		Position neighbours[4] = { position.north_position(), position.south_position(), position.east_position(), position.west_position() };
+		for (auto& neighbour : neighbours)
+			if (!get_cell(neighbour).is_occupied_by_inacessible_building() && !get_cell(neighbour).void_cell && neighbour != position)
+				adjacency_list.add(position, neighbour);
+
+		compute_adjacency_enemy(position);
+		compute_adjacency_ally(position);
+	}
+	void update_territory_bitboards()
+	{
+		board_ally_active.clear();
+		board_ally_inactive.clear();
+		board_enemy_active.clear();
+		board_enemy_inactive.clear();
+		board_neutral.clear();
+		board_void.clear();
 
-		// Scores
-		for (int i = 0; i < width; i++)
-			for (int j = 0; j < height; j++)
-				score_enemy[j][i] = 0;
-
-		for (auto& enemy : units_enemy)
-			for (int i = 0; i < width; i++)
-				for (int j = 0; j < height; j++)
-					if (get_distance(enemy->p, Position(i, j)) <= 3 && get_cell_info(enemy->p) == 'X')
-						score_enemy[j][i] += enemy->level;
-
-
-		// Towers around
-		for (int i = 0; i < width; i++)
-			for (int j = 0; j < height; j++)
-				enemy_towers_around[j][i] = ally_towers_around[j][i] = 0;
-
-
 		for (int i = 0; i < width; i++)
 			for (int j = 0; j < height; j++)
 			{
-				for (auto& building : buildings_enemy)
-					if (get_distance(building->p, Position(i, j)) <= 1)
-						enemy_towers_around[j][i] += 1;
-
-				for (auto& building : buildings_ally)
-					if (get_distance(building->p, Position(i, j)) <= 1)
-						ally_towers_around[j][i] += 1;
+				Position position(i, j);
+				switch (cells_info[j][i])
+				{
+				case 'O':
+					board_ally_active.set(position);
+					break;
+				case 'o':
+					board_ally_inactive.set(position);
+					break;
+				case 'X':
+					board_enemy_active.set(position);
+					break;
+				case 'x':
+					board_enemy_inactive.set(position);
+					break;
+				case '#':
+					board_void.set(position);
+					break;
+				default:
+					board_neutral.set(position);
+					break;
+				}
 			}
+
+		board_passable = ~board_void;
 	}
-	void compute_adjacency_list_enemy()
+	void compute_adjacency_enemy(const Position& position)
 	{
-		adjacency_list_position_enemy.clear();
-		for (int i = 0; i < width; ++i)
-			for (int j = 0; j < height; ++j)
-			{
-				vector<Position> positions;
-				Position position(i, j);
-
-				if (get_cell_info(position) != 'X')
-					continue;
+		adjacency_list_position_enemy.clear(position);
 
-				Position north_position = position.north_position();
-				if (get_cell_info(north_position) == 'X' && north_position != position)
-					positions.push_back(north_position);
+		if (get_cell_info(position) != 'X')
+			return;
 
-				Position south_position = position.south_position();
-				if (get_cell_info(south_position) == 'X' && south_position != position)
-					positions.push_back(south_position);
+		Position north_position = position.north_position();
+		if (get_cell_info(north_position) == 'X' && north_position != position)
+			adjacency_list_position_enemy.add(position, north_position);
 
-				Position east_position = position.east_position();
-				if (get_cell_info(east_position) == 'X' && east_position != position)
-					positions.push_back(east_position);
+		Position south_position = position.south_position();
+		if (get_cell_info(south_position) == 'X' && south_position != position)
+			adjacency_list_position_enemy.add(position, south_position);
 
-				Position west_position = position.west_position();
-				if (get_cell_info(west_position) == 'X' && west_position != position)
-					positions.push_back(west_position);
+		Position east_position = position.east_position();
+		if (get_cell_info(east_position) == 'X' && east_position != position)
+			adjacency_list_position_enemy.add(position, east_position);
 
-				adjacency_list_position_enemy[position] = positions;
-			}
+		Position west_position = position.west_position();
+		if (get_cell_info(west_position) == 'X' && west_position != position)
+			adjacency_list_position_enemy.add(position, west_position);
 	}
 	void compute_adjacency_list_enemy_for_cut()
 	{
@@ -1046,7 +2168,6 @@ public:
 		for (int i = 0; i < width; ++i)
 			for (int j = 0; j < height; ++j)
 			{
-				vector<Position> positions;
 				Position position(i, j);
 
 				char info = get_cell_info(position);
@@ -1056,24 +2177,22 @@ public:
 				Position north_position = position.north_position();
 				char north_info = get_cell_info(north_position);
 				if ((north_info == 'X' || north_info == 'x' || north_info == '.' || north_info == 'o') && north_position != position)
-					positions.push_back(north_position);
+					adjacency_list_position_enemy_for_cut.add(position, north_position);
 
 				Position south_position = position.south_position();
 				char south_info = get_cell_info(south_position);
 				if ((south_info == 'X' || south_info == 'x' || south_info == '.' || south_info == 'o') && south_position != position)
-					positions.push_back(south_position);
+					adjacency_list_position_enemy_for_cut.add(position, south_position);
 
 				Position east_position = position.east_position();
 				char east_info = get_cell_info(east_position);
 				if ((east_info == 'X' || east_info == 'x' || east_info == '.' || east_info == 'o') && east_position != position)
-					positions.push_back(east_position);
+					adjacency_list_position_enemy_for_cut.add(position, east_position);
 
 				Position west_position = position.west_position();
 				char west_info = get_cell_info(west_position);
 				if ((west_info == 'X' || west_info == 'x' || west_info == '.' || west_info == 'o') && west_position != position)
-					positions.push_back(west_position);
-
-				adjacency_list_position_enemy_for_cut[position] = positions;
+					adjacency_list_position_enemy_for_cut.add(position, west_position);
 			}
 	}
 	void compute_adjacency_list_ally_for_cut()
@@ -1082,7 +2201,6 @@ public:
 		for (int i = 0; i < width; ++i)
 			for (int j = 0; j < height; ++j)
 			{
-				vector<Position> positions;
 				Position position(i, j);
 
 				char info = get_cell_info(position);
@@ -1092,61 +2210,85 @@ public:
 				Position north_position = position.north_position();
 				char north_info = get_cell_info(north_position);
 				if ((north_info == 'O' || north_info == 'o' || north_info == '.' || north_info == 'x') && north_position != position)
-					positions.push_back(north_position);
+					adjacency_list_position_ally_for_cut.add(position, north_position);
 
 				Position south_position = position.south_position();
 				char south_info = get_cell_info(south_position);
 				if ((south_info == 'O' || south_info == 'o' || south_info == '.' || south_info == 'x') && south_position != position)
-					positions.push_back(south_position);
+					adjacency_list_position_ally_for_cut.add(position, south_position);
 
 				Position east_position = position.east_position();
 				char east_info = get_cell_info(east_position);
 				if ((east_info == 'O' || east_info == 'o' || east_info == '.' || east_info == 'x') && east_position != position)
-					positions.push_back(east_position);
+					adjacency_list_position_ally_for_cut.add(position, east_position);
 
 				Position west_position = position.west_position();
 				char west_info = get_cell_info(west_position);
 				if ((west_info == 'O' || west_info == 'o' || west_info == '.' || west_info == 'x') && west_position != position)
-					positions.push_back(west_position);
-
-				adjacency_list_position_ally_for_cut[position] = positions;
+					adjacency_list_position_ally_for_cut.add(position, west_position);
 			}
 	}
-	void compute_adjacency_list_ally()
+	void compute_adjacency_ally(const Position& position)
 	{
-		adjacency_list_position_ally.clear();
-		for (int i = 0; i < width; i++)
-			for (int j = 0; j < height; j++)
-			{
-				vector<Position> positions;
-				Position position(i, j);
+		adjacency_list_position_ally.clear(position);
 
-				if (cells_info[j][i] != 'O')
-					continue;
-
-				Position north_position = position.north_position();
-				if (get_cell_info(north_position) == 'O' && north_position != position)
-					positions.push_back(north_position);
+		if (get_cell_info(position) != 'O')
+			return;
 
-				Position south_position = position.south_position();
-				if (get_cell_info(south_position) == 'O' && south_position != position)
-					positions.push_back(south_position);
+		Position north_position = position.north_position();
+		if (get_cell_info(north_position) == 'O' && north_position != position)
+			adjacency_list_position_ally.add(position, north_position);
 
-				Position east_position = position.east_position();
-				if (get_cell_info(east_position) == 'O' && east_position != position)
-					positions.push_back(east_position);
+		Position south_position = position.south_position();
+		if (get_cell_info(south_position) == 'O' && south_position != position)
+			adjacency_list_position_ally.add(position, south_position);
 
-				Position west_position = position.west_position();
-				if (get_cell_info(west_position) == 'O' && west_position != position)
-					positions.push_back(west_position);
+		Position east_position = position.east_position();
+		if (get_cell_info(east_position) == 'O' && east_position != position)
+			adjacency_list_position_ally.add(position, east_position);
 
-				adjacency_list_position_ally[position] = positions;
-			}
+		Position west_position = position.west_position();
+		if (get_cell_info(west_position) == 'O' && west_position != position)
+			adjacency_list_position_ally.add(position, west_position);
 	}
 	void send_commands()
 	{
-		for_each(commands.begin(), commands.end(), [](Command &c) { c.print(); });
-		cout << "WAIT" << endl;
+		for_each(commands.begin(), commands.end(), [this](Command &c) { c.print(output); });
+		output << "WAIT" << endl;
+	}
+	void play_turn()
+	{
+		Stopwatch s("Turn total time");
+
+		update_gamestate();
+
+		if (use_ga)
+		{
+			budget.plan({ PHASE_GA });
+			execute_genetic_algorithm();
+		}
+		else
+		{
+			budget.plan({ PHASE_CHAINKILL, PHASE_MOVES, PHASE_CUTS, PHASE_TOWERS, PHASE_TRAIN_ON_CUTS, PHASE_TRAIN });
+
+			// Nothing else matters once the HQ falls
+			if (!attempt_lethal())
+			{
+				move_units();
+				attempt_chainkill();
+				search_cuts();
+
+				build_towers();
+
+				train_units_on_cuts();
+				train_units();
+
+				debug();
+			}
+		}
+
+		budget.finish_phase();
+		send_commands();
 	}
 
 
@@ -1154,12 +2296,19 @@ public:
 	void build_towers()
 	{
 		Stopwatch s("Towers");
+		budget.start_phase(PHASE_TOWERS);
 
 		compute_adjacency_list_ally_for_cut();
 
 		double cuts[width][height] = {};
 		for (auto& position : get_frontier_spawn_enemy(1))
 		{
+			if (budget.phase_expired())
+			{
+				cerr << "Towers: out of time" << endl;
+				break;
+			}
+
 			auto pair = search({ position }, 4, false);
 
 			if (pair.first > 0.0)
@@ -1177,8 +2326,22 @@ public:
 			}
 		}
 
+		// A chainkill to our HQ outweighs any cut, the tower goes where it covers the chain
+		vector<Position> threat_path;
+		int threat = get_chainkill_threat(threat_path);
+		Bitboard candidates = Bitboard::from(get_frontier_ally(3));
+		if (threat >= 0)
+		{
+			cerr << "Chainkill threat: " << threat_path.front().print() << " cost: " << threat << endl;
+
+			Bitboard covering = Bitboard::from(threat_path).dilate() & board_ally_active;
+			for (auto& position : covering.to_positions())
+				cuts[position.y][position.x] += 1000.0;
+			candidates |= covering;
+		}
+
 		double scores[width][height] = {};
-		for (auto& position : get_frontier_ally(3))
+		for (auto& position : candidates.to_positions())
 		{
 			int i = position.x;
 			int j = position.y;
@@ -1206,7 +2369,7 @@ public:
 				score += cuts[j][i] * 5.0;
 
 				// assume we are on the offensive then, no need for towers
-				if (get_distance(position, hq_ally->p) > 13)
+				if (get_distance(position, hq_ally->p) > 13 && threat < 0)
 					score = 0.0;
 
 				scores[j][i] = score;
@@ -1228,29 +2391,22 @@ public:
 
 		cerr << "Best tower cell: " << max_position.print() << " score: " << max_score << endl;
 
-		bool close_to_enemy = false;
-		for (auto& position_ally : positions_ally)
-			for (auto& position_enemy : positions_enemy)
-				if (get_distance(position_ally, position_enemy) <= 2)
-				{
-					close_to_enemy = true;
-					goto can_spawn_tower;
-				}
-	can_spawn_tower:
-
-		if (!close_to_enemy)
+		if (!is_close_to_enemy(2) && threat < 0)
 			return;
 
 		if (gold_ally >= tower_cost && max_score > 80.0)
 		{
 			commands.push_back(Command(BUILD, "TOWER", max_position));
 			refresh_gamestate_for_building(make_shared<Building>(Building(max_position.x, max_position.y, TOWER, 0)));
+
+			if (threat >= 0)
+				cerr << "Chainkill threat after the tower: " << get_chainkill_threat(threat_path) << endl;
 		}
 	}
 
 
 	// Training new units
-	double get_training_score(const shared_ptr<Unit>& unit, const Position& pos, const int allies_at_distance[width][height], int level)
+	double get_training_score(const shared_ptr<Unit>& unit, const Position& pos, const InfluenceMap<int>& allies_at_distance, int level)
 	{
 		if (level == 1)
 		{
@@ -1271,7 +2427,7 @@ public:
 				score += enemy_on_cell * 20.0;
 				score += enemy_building_on_cell * 20.0;
 				score += enemy_territory * 10.0;
-				//score += close_to_enemy * allies_at_distance[pos.y][pos.x] * 10.0;
+				//score += close_to_enemy * allies_at_distance.get(pos) * 10.0;
 
 				return score;
 			}
@@ -1296,6 +2452,7 @@ public:
 	unordered_map<Position, double, HashPosition> find_training_positions(int level)
 	{
 		vector<Position> positions_available;
+		Bitboard attainable = board_ally_active.neighbours() & board_passable;
 
 		for (int i = 0; i < width; i++)
 			for (int j = 0; j < height; j++)
@@ -1305,25 +2462,13 @@ public:
 				if (get_cells_level_ally(pos) > level || get_cells_used_movement(pos))
 					continue;
 
-				bool attainable = false;
-				for (int k = 0; k < width; k++)
-					for (int l = 0; l < height; l++)
-						if (get_distance(pos, Position(k, l)) == 1 && get_cell_info(Position(k, l)) == 'O')
-						{
-							attainable = true;
-							break;
-						}
-
-				if (attainable)
+				if (attainable.test(pos))
 					positions_available.push_back(pos);
 			};
 
-		int allies_at_distance[width][height] = {};
+		InfluenceMap<int> allies_at_distance(stencils[3]);
 		for (auto& position : positions_ally)
-			for (int i = 0; i < width; i++)
-				for (int j = 0; j < height; j++)
-					if (get_distance(Position(i, j), position) <= 3)
-						allies_at_distance[j][i] += 1;
+			allies_at_distance.add(position, 1);
 
 		unordered_map<Position, double, HashPosition> positions_for_spawn;
 		for (auto& pos : positions_available)
@@ -1339,10 +2484,8 @@ public:
 	{
 		if (level == 1)
 		{
-			for (auto& position_ally : positions_ally)
-				for (auto& position_enemy : positions_enemy)
-					if (get_distance(position_ally, position_enemy) <= 1)
-						return false;
+			if (is_close_to_enemy(1))
+				return false;
 
 			return nbr_units_ally_of_level(1) <= 8;
 		}
@@ -1363,11 +2506,13 @@ public:
 	}
 	void train_units()
 	{
+		budget.start_phase(PHASE_TRAIN);
+
 		for (int level : {3, 2, 1})
 		{
 			Stopwatch s("Train units of level" + to_string(level));
 
-			while (need_train_units(level) && can_train_level(level))
+			while (need_train_units(level) && can_train_level(level) && !budget.phase_expired())
 			{
 				unordered_map<Position, double, HashPosition> training_positions = find_training_positions(level);
 
@@ -1389,22 +2534,78 @@ public:
 	void move_units()
 	{
 		Stopwatch s("Generate Moves");
+		budget.start_phase(PHASE_MOVES);
 
 		fill_cuts_for_move();
 		assign_objective_to_units();
 
-		for (auto& unit : units_in_order)
+#ifdef RHEA_PLANNER
+		if (use_rhea)
 		{
-			Position destination = get_path(unit, unit->objective.target, false);
+			apply_moves(units_in_order, plan_moves(units_in_order));
+			return;
+		}
+#endif
 
-			cerr << "Path for: " << unit->id << ", want to move to " << destination.print() << endl;
+		apply_moves(units_in_order, plan_routes(units_in_order));
+	}
+	// Moves all the units at once from one state: every move is checked against the state before any of them, a cell goes
+	// to the first unit claiming it, and a unit stepping onto the cell of another one is ordered after it. The moves left
+	// waiting on a unit that stays, or on each other, are dropped. The game state is refreshed once at the end.
+	void apply_moves(const vector<shared_ptr<Unit>>& units, const vector<Position>& destinations)
+	{
+		Bitboard occupied = board_units_ally[1] | board_units_ally[2] | board_units_ally[3];
+		Bitboard leaving;
+		for (int i = 0; i < units.size(); i++)
+			if (!(destinations[i] == units[i]->p))
+				leaving.set(units[i]->p);
+
+		// A cell one of our units leaves is our territory like the cells around it, any unit next to it may follow
+		Bitboard claimed;
+		vector<int> pending;
+		for (int i = 0; i < units.size(); i++)
+		{
+			bool vacated = leaving.test(destinations[i]);
+			bool legal = vacated ? get_distance(destinations[i], units[i]->p) <= 1 : unit_can_move_to_destination(units[i], destinations[i]);
+			if (!(destinations[i] == units[i]->p) && legal && !claimed.test(destinations[i]))
+			{
+				claimed.set(destinations[i]);
+				pending.push_back(i);
+			}
+		}
 
-			if (unit_can_move_to_destination(unit, destination))
+		vector<int> ordered;
+		for (bool progress = true; progress; )
+		{
+			progress = false;
+			for (auto it = pending.begin(); it != pending.end(); )
 			{
-				commands.push_back(Command(MOVE, unit->id, destination));
-				refresh_gamestate_for_movement(unit, destination);
+				if (occupied.test(destinations[*it]))
+				{
+					it++;
+					continue;
+				}
+
+				occupied.reset(units[*it]->p);
+				occupied.set(destinations[*it]);
+				ordered.push_back(*it);
+				it = pending.erase(it);
+				progress = true;
 			}
 		}
+
+		for (int i : ordered)
+		{
+			cerr << "Move: " << units[i]->id << " to " << destinations[i].print() << endl;
+#ifdef DEBUG_GAMESTATE
+			debug_chain_moves += leaving.test(destinations[i]);
+#endif
+
+			commands.push_back(Command(MOVE, units[i]->id, destinations[i]));
+			record_movement(units[i], destinations[i]);
+		}
+
+		refresh_gamestate();
 	}
 	void fill_cuts_for_move()
 	{
@@ -1440,6 +2641,166 @@ public:
 		//	cerr << endl;
 		//}
 	}
+#ifdef RHEA_PLANNER
+	// Rolling horizon planner: evolves RHEA_TURNS moves for all units together, warm started from last turn's best plan.
+	// Returns the first step of each unit.
+	vector<Position> plan_moves(const vector<shared_ptr<Unit>>& units)
+	{
+		Stopwatch s("Plan moves");
+
+		if (units.empty())
+			return {};
+
+		PlannerContext context;
+		for (auto& unit : units)
+		{
+			context.cells.push_back(Bitboard::index(unit->p));
+			context.levels.push_back(unit->level);
+			context.targets.push_back(unit->objective.score > -DBL_MAX ? Bitboard::index(unit->objective.target) : -1);
+		}
+		for (int cell = 0; cell < width * height; cell++)
+		{
+			Position position = Bitboard::position(cell);
+			char info = get_cell_info(position);
+
+			for (int level = 1; level <= 3; level++)
+				if (info != '#' && get_cells_level_ally(position) <= level && !get_cell(position).is_occupied_by_inacessible_building())
+					context.enterable[level].set(position);
+
+			double value = info == 'X' ? 15.0 : info == 'x' ? 12.5 : info == '.' ? 10.0 : 0.0;
+			value += get_cell(position).is_occupied_by_enemy_unit() * 25.0;
+			value += get_cell(position).is_occupied_by_enemy_building() * 20.0;
+			value += max(0.0, get_cuts_ally(position)) * 10.0;
+			value += max(0.0, get_cuts_enemy(position)) * 8.0;
+			context.cell_value[cell] = value;
+		}
+		context.occupied = board_units_ally[1] | board_units_ally[2] | board_units_ally[3];
+		context.owned = board_ally_active | board_ally_inactive;
+		context.hq_enemy = Bitboard::index(hq_enemy->p);
+
+		const int genes = units.size() * RHEA_TURNS;
+		vector<uint8_t> population(RHEA_POPULATION_SIZE * genes);
+		vector<uint8_t> offspring(RHEA_POPULATION_SIZE * genes);
+		double fitness[RHEA_POPULATION_SIZE];
+		double offspring_fitness[RHEA_POPULATION_SIZE];
+		XorShift rng(((uint64_t)rand() << 32) ^ (uint64_t)rand());
+
+		// Individual 0 is last turn's plan shifted by one turn, individual 1 walks to the objectives, the others mutate them
+		for (int u = 0; u < units.size(); u++)
+		{
+			auto previous = rhea_plan.find(units[u]->id);
+			int cell = context.cells[u];
+
+			for (int t = 0; t < RHEA_TURNS; t++)
+			{
+				population[u * RHEA_TURNS + t] = (previous != rhea_plan.end() && t + 1 < RHEA_TURNS) ? previous->second[t + 1] : rng.below(5);
+
+				int best_move = 4;
+				for (int move = 0; move < 4 && context.targets[u] >= 0; move++)
+					if (context.enterable[context.levels[u]].bits.test(step_cell(cell, move)) && distances[step_cell(cell, move)][context.targets[u]] < distances[step_cell(cell, best_move)][context.targets[u]])
+						best_move = move;
+				population[genes + u * RHEA_TURNS + t] = best_move;
+				cell = step_cell(cell, best_move);
+			}
+		}
+		for (int i = 2; i < RHEA_POPULATION_SIZE; i++)
+		{
+			copy(population.begin() + (i % 2) * genes, population.begin() + (i % 2 + 1) * genes, population.begin() + i * genes);
+			mutate_plan(&population[i * genes], genes, rng);
+		}
+		for (int i = 0; i < RHEA_POPULATION_SIZE; i++)
+			fitness[i] = evaluate_plan(&population[i * genes], context);
+
+		int generation = 0;
+		while (genes && generation++ < RHEA_MAX_GENERATIONS && !budget.phase_expired())
+		{
+			int best = max_element(fitness, fitness + RHEA_POPULATION_SIZE) - fitness;
+			copy(population.begin() + best * genes, population.begin() + (best + 1) * genes, offspring.begin());
+			offspring_fitness[0] = fitness[best];
+
+			auto select = [&]()
+			{
+				int a = rng.below(RHEA_POPULATION_SIZE), b = rng.below(RHEA_POPULATION_SIZE);
+				return fitness[a] >= fitness[b] ? a : b;
+			};
+
+			for (int i = 1; i < RHEA_POPULATION_SIZE; i++)
+			{
+				// Uniform crossover on whole units keeps each unit's moves consistent
+				int parent1 = select(), parent2 = select();
+				for (int u = 0; u < units.size(); u++)
+				{
+					int parent = rng.below(2) ? parent1 : parent2;
+					copy(population.begin() + parent * genes + u * RHEA_TURNS, population.begin() + parent * genes + (u + 1) * RHEA_TURNS, offspring.begin() + i * genes + u * RHEA_TURNS);
+				}
+				mutate_plan(&offspring[i * genes], genes, rng);
+				offspring_fitness[i] = evaluate_plan(&offspring[i * genes], context);
+			}
+
+			swap(population, offspring);
+			copy(offspring_fitness, offspring_fitness + RHEA_POPULATION_SIZE, fitness);
+		}
+
+		int best = max_element(fitness, fitness + RHEA_POPULATION_SIZE) - fitness;
+		cerr << "Planner generations: " << generation << ", fitness: " << fitness[best] << endl;
+
+		rhea_plan.clear();
+		vector<Position> destinations;
+		for (int u = 0; u < units.size(); u++)
+		{
+			rhea_plan[units[u]->id] = vector<uint8_t>(population.begin() + best * genes + u * RHEA_TURNS, population.begin() + best * genes + (u + 1) * RHEA_TURNS);
+			destinations.push_back(Bitboard::position(step_cell(context.cells[u], rhea_plan[units[u]->id][0])));
+		}
+		return destinations;
+	}
+	void mutate_plan(uint8_t* plan, int genes, XorShift& rng)
+	{
+		for (int mutations = 1 + rng.below(2); mutations > 0 && genes; mutations--)
+			plan[rng.below(genes)] = rng.below(5);
+	}
+	// Plays the plan with the enemy standing still: discounted value of the cells taken, minus the distance left to the enemy HQ.
+	// Moves onto a cell the unit cannot take, or onto one of our units, leave the unit in place.
+	double evaluate_plan(const uint8_t* plan, const PlannerContext& context)
+	{
+		int cells[width * height];
+		copy(context.cells.begin(), context.cells.end(), cells);
+		Bitboard occupied = context.occupied;
+		Bitboard owned = context.owned;
+
+		double score = 0.0;
+		double discount = 1.0;
+		for (int t = 0; t < RHEA_TURNS; t++)
+		{
+			for (int u = 0; u < context.cells.size(); u++)
+			{
+				int from = cells[u];
+				int to = step_cell(from, plan[u * RHEA_TURNS + t]);
+				if (to == from || !context.enterable[context.levels[u]].bits.test(to) || occupied.bits.test(to))
+					continue;
+
+				occupied.bits.reset(from);
+				occupied.bits.set(to);
+				cells[u] = to;
+
+				if (!owned.bits.test(to))
+				{
+					owned.bits.set(to);
+					score += discount * context.cell_value[to];
+				}
+			}
+			discount *= RHEA_DISCOUNT;
+		}
+
+		for (int u = 0; u < context.cells.size(); u++)
+		{
+			score -= distances[cells[u]][context.hq_enemy];
+			if (context.targets[u] >= 0)
+				score -= 10.0 * distances[cells[u]][context.targets[u]];
+		}
+
+		return score;
+	}
+#endif
 	bool unit_can_move_to_destination(const shared_ptr<Unit>& unit, const Position& target)
 	{
 		return (
@@ -1449,117 +2810,192 @@ public:
 			!get_cell(target).is_occupied_by_ally_unit()
 			);
 	}
-	Position get_path(const shared_ptr<Unit>& unit, Position target, bool debug)
+	// Routes of the units over the next ROUTE_TURNS turns, each searched in the units' order around the cells the units before
+	// it reserved at each turn (cooperative A*), returns where each unit steps this turn. A unit keeps last turn's route for
+	// as long as it is still valid and only the rest of it is searched again.
+	vector<Position> plan_routes(const vector<shared_ptr<Unit>>& units)
 	{
-		if (unit->p == target || (get_distance(unit->p, target) == 1))
-			return target;
+		for (auto& layer : reserved)
+			layer.clear();
+
+		// Units are still on their cell when the units before them move, those without an objective stay there
+		Bitboard waiting;
+		for (auto& unit : units_ally)
+		{
+			waiting.set(unit->p);
+			if (find(units.begin(), units.end(), unit) == units.end())
+				for (auto& layer : reserved)
+					layer.set(unit->p);
+		}
 
-		vector<Position> optimal_path = dijkstra(unit, target, debug);
+		unordered_map<int, Route> previous_routes;
+		previous_routes.swap(routes);
 
-		if (optimal_path.size() > 1)
-			return optimal_path.at(1);
-		else
-			return unit->p;
+		vector<Position> destinations;
+		for (auto& unit : units)
+		{
+			waiting.reset(unit->p);
+
+			if (budget.phase_expired())
+			{
+				cerr << "Moves: out of time" << endl;
+				destinations.push_back(unit->p);
+				continue;
+			}
+
+			Route route;
+			route.target = Bitboard::index(unit->objective.target);
+			route.cells.push_back(Bitboard::index(unit->p));
+
+			auto previous = previous_routes.find(unit->id);
+			if (previous != previous_routes.end() && previous->second.target == route.target)
+			{
+				const vector<uint8_t>& cells = previous->second.cells;
+				if (cells.size() > 1 && cells[1] == route.cells[0])
+					for (int t = 2; t < (int)cells.size() && can_route(unit, route.cells.back(), cells[t], route.cells.size() - 1, waiting); t++)
+						route.cells.push_back(cells[t]);
+			}
+
+			search_route(unit, route, waiting);
+
+			for (int t = 0; t <= ROUTE_TURNS; t++)
+				reserved[t].bits.set(route.cells[min(t, (int)route.cells.size() - 1)]);
+
+			destinations.push_back(Bitboard::position(route.cells[min(1, (int)route.cells.size() - 1)]));
+			routes[unit->id] = route;
+		}
+
+		return destinations;
 	}
-	double compute_next_step_score(const shared_ptr<Unit>& unit, const Position& target, const Position& current, const Position& next)
+	// Whether the unit can go from cell from at turn t to cell to at turn t + 1, staying or stepping
+	bool can_route(const shared_ptr<Unit>& unit, int from, int to, int t, const Bitboard& waiting)
 	{
-		double score = 1.0;
-
-		// Too low level to move to position
-		//if (unit->level < get_cells_level(next))
-		//	score += 1000.0;
+		if (reserved[t + 1].bits.test(to))
+			return false;
+		if (to == from)
+			return true;
+		if (t == 0 && waiting.bits.test(to))
+			return false;
 
-		if (get_cell_info(next) == '#')
-			score += 1000.0;
+		// A unit routed before has left its cell, our territory then like the cells around it. Guards and towers are
+		// checked at every step, as captures on the way seldom lower them.
+		bool vacated = (board_units_ally[1] | board_units_ally[2] | board_units_ally[3]).bits.test(to);
+		if (!vacated && get_cells_level_ally(Bitboard::position(to)) > unit->level)
+			return false;
 
-		// Someone already moving there
-		if (get_cells_used_movement(next))
-			score += 1000.0;
+		for (auto& neighbour : adjacency_list[Bitboard::position(from)])
+			if (Bitboard::index(neighbour) == to)
+				return true;
 
-		return score;
+		return false;
 	}
-	vector<Position> dijkstra(const shared_ptr<Unit>& unit, const Position& target, bool debug)
+	// Extends the route to the target over (cell, turn) states, or when it is too far to the state the closest to it.
+	// Every step takes a turn, so the cost of a state is its turn and a state is final once reached.
+	void search_route(const shared_ptr<Unit>& unit, Route& route, const Bitboard& waiting)
 	{
-		unordered_map<Position, Position, HashPosition> came_from;
-		came_from[unit->p] = unit->p;
+		int start = route.cells.back();
+		int start_turn = route.cells.size() - 1;
+		if (start == route.target || start_turn == ROUTE_TURNS)
+			return;
 
-		MinPriorityQueue<Position, double> frontier;
-		frontier.put(unit->p, 0.0);
+		const int* field = get_path_field(Bitboard::position(route.target));
+		auto estimate = [&](int cell) { return field[cell] == INT_MAX ? width * height : field[cell]; };
 
-		unordered_map<Position, double, HashPosition> cost_so_far;
-		cost_so_far[unit->p] = 0.0;
+		Bitboard reached[ROUTE_TURNS + 1];
+		int came_from[ROUTE_TURNS + 1][width * height];
+		priority_queue<tuple<int, int, int>, vector<tuple<int, int, int>>, greater<tuple<int, int, int>>> frontier;
+		frontier.push(make_tuple(start_turn + estimate(start), start_turn, start));
+		reached[start_turn].bits.set(start);
 
+		int best_cell = start, best_turn = start_turn;
 		while (!frontier.empty())
 		{
-			Position current = frontier.pop();
-
-			//if (debug)
-			//{
-			//	cerr << "current: " << current.print() << " ";
-			//	auto tt = get_adjacency_list(current);
-			//	cerr << tt.size();
-			//	for (auto& t : tt)
-			//		cerr << t.print();
-			//}
-
-			if (current == target)
-				return reconstruct_path(unit->p, target, came_from);
+			int turn = get<1>(frontier.top());
+			int cell = get<2>(frontier.top());
+			frontier.pop();
 
-			for (const Position& next : get_adjacency_list(current))
+			if (estimate(cell) < estimate(best_cell))
 			{
-				double new_cost = cost_so_far[current] + compute_next_step_score(unit, target, current, next);
-
-				//if (debug)
-				//	cerr << "next: " << next.print() << " s: " << new_cost << ", ";
+				best_cell = cell;
+				best_turn = turn;
+			}
+			if (cell == route.target || turn == ROUTE_TURNS)
+				continue;
 
-				if ((cost_so_far.find(next) == cost_so_far.end()) || (new_cost < cost_so_far[next]))
+			Position position = Bitboard::position(cell);
+			auto visit = [&](int next)
+			{
+				if (!reached[turn + 1].bits.test(next) && can_route(unit, cell, next, turn, waiting))
 				{
-					cost_so_far[next] = new_cost;
-					came_from[next] = current;
-					frontier.put(next, new_cost);
+					reached[turn + 1].bits.set(next);
+					came_from[turn + 1][next] = cell;
+					frontier.push(make_tuple(turn + 1 + estimate(next), turn + 1, next));
 				}
+			};
 
-				//if (debug)
-				//	cerr << endl;
-			}
+			visit(cell);
+			for (auto& neighbour : adjacency_list[position])
+				visit(Bitboard::index(neighbour));
 		}
 
-		return reconstruct_path(unit->p, target, came_from);
+		vector<uint8_t> extension;
+		for (int turn = best_turn, cell = best_cell; turn > start_turn; cell = came_from[turn--][cell])
+			extension.push_back(cell);
+		route.cells.insert(route.cells.end(), extension.rbegin(), extension.rend());
 	}
-	vector<Position> reconstruct_path(Position source, Position target, unordered_map<Position, Position, HashPosition> came_from)
+	// Path lengths from each cell to target, INT_MAX where there is none. Fields are shared by all the units heading to the
+	// same target and kept until the paths change, i.e. until a new turn or one of our mines.
+	const int* get_path_field(const Position& target)
 	{
-		vector<Position> path;
-		Position current = target;
-		while (current != source)
+		int index = Bitboard::index(target);
+		if (!path_field_valid[index])
+		{
+			compute_path_field(index);
+			path_field_valid[index] = true;
+		}
+#ifdef DEBUG_GAMESTATE
+		else
 		{
-			path.push_back(current);
-			current = came_from[current];
+			int kept[width * height];
+			copy(path_fields[index], path_fields[index] + width * height, kept);
+			compute_path_field(index);
+			bool same = equal(kept, kept + width * height, path_fields[index]);
+
+			if (!same)
+				cerr << "Kept path field differs from a new one" << endl;
+			assert(same);
 		}
-		path.push_back(source);
-		reverse(path.begin(), path.end());
-		return path;
+#endif
+
+		return path_fields[index];
 	}
-	Objective find_target(const shared_ptr<Unit>& unit)
+	// Breadth first backwards from the target
+	void compute_path_field(int target)
 	{
-		Position target = hq_enemy->p;
-		double max_score = -DBL_MAX;
-
-		for (int i = 0; i < width; i++)
-			for (int j = 0; j < height; j++)
-			{
-				Position pos(i, j);
+		int* field = path_fields[target];
+		fill(field, field + width * height, INT_MAX);
 
-				double score = get_score(unit, pos);
+		int queue[width * height];
+		int head = 0, tail = 0;
+		field[target] = 0;
+		queue[tail++] = target;
 
-				if (score > max_score)
+		while (head < tail)
+		{
+			int current = queue[head++];
+			for (auto& next : adjacency_list[Bitboard::position(current)])
+			{
+				int next_index = Bitboard::index(next);
+				if (field[next_index] == INT_MAX)
 				{
-					target = pos;
-					max_score = score;
+					field[next_index] = field[current] + 1;
+					queue[tail++] = next_index;
 				}
 			}
-
-		return Objective(target, max_score);
+		}
 	}
+	inline void use_cell_for_movement(const Position& position) { cells_used_movement[position.y][position.x] = 1; }
+	// Score of the cell as the unit's objective, get_scores computes it for all the cells at once
 	double get_score(const shared_ptr<Unit>& unit, const Position& pos)
 	{
 		if (unit->level < get_cells_level_ally(pos) || cells_used_objective[pos.y][pos.x] || cells_used_movement[pos.y][pos.x] || cells_info[pos.y][pos.x] == 'O')
@@ -1598,50 +3034,147 @@ public:
 			score += cut_ally_distance_one * get_cuts_ally(pos) * 10.0;
 			score += cut_enemy_distance_one * get_cuts_enemy(pos) * 8.0;
 
+			score += threat_cells.test(pos) * THREAT_PATH_BONUS;
 			score -= distance_to_enemy_hq;
 			score -= distance;
 
 			return score;
 		}
 	}
+	// Everything get_score reads about a cell that does not depend on the unit, once per state
+	void compute_score_planes()
+	{
+		for (int index = 0; index < width * height; index++)
+		{
+			Position pos = Bitboard::position(index);
+			char info = cells_info[pos.y][pos.x];
+
+			plane_enemy_unit[index] = get_cell(pos).is_occupied_by_enemy_unit();
+			plane_enemy_building[index] = get_cell(pos).is_occupied_by_enemy_building();
+			plane_territory[index] = info == 'X' ? 15.0 : info == 'x' ? 12.5 : info == '.' ? 10.0 : 0.0;
+			plane_cuts[index] = max(get_cuts_ally(pos), 0.0) * 10.0 + max(get_cuts_enemy(pos), 0.0) * 8.0;
+			plane_base[index] = threat_cells.bits.test(index) * THREAT_PATH_BONUS - get_distance(pos, hq_enemy->p);
+
+			bool used = cells_used_objective[pos.y][pos.x] || cells_used_movement[pos.y][pos.x] || info == 'O';
+			for (int level = 1; level <= 3; level++)
+				plane_bound[level][index] = used || get_cells_level_ally(pos) > level ? -DBL_MAX : DBL_MAX;
+		}
+	}
+	// get_score of every cell for the unit, from the planes and the unit's row of distances, first widened to doubles with
+	// their inverses. The loop then indexes arrays directly, which tells GCC they do not overlap, and has no branches: the
+	// forbidden cells are clamped with min, as selecting -DBL_MAX with a comparison would stop it. It is vectorised at -O2.
+	const double* get_scores(const shared_ptr<Unit>& unit)
+	{
+		int source = Bitboard::index(unit->p);
+		int level = unit->level;
+		double weight_unit = level <= 2 ? 25.0 : 20.0;
+		double weight_building = level <= 2 ? 20.0 : 25.0;
+
+		double distance[width * height];
+		double inverse_distance[width * height]; // 0 from the unit's cell
+		for (int index = 0; index < width * height; index++)
+		{
+			distance[index] = distances[source][index];
+			inverse_distance[index] = index == source ? 0.0 : 1.0 / distance[index];
+		}
+
+		for (int index = 0; index < width * height; index++)
+		{
+			double inverse = inverse_distance[index];
+			double score = inverse * (weight_unit * plane_enemy_unit[index] + weight_building * plane_enemy_building[index] + plane_territory[index])
+				+ (inverse >= 1.0) * plane_cuts[index] + plane_base[index] - distance[index];
+			unit_scores[index] = min(score, plane_bound[level][index]);
+		}
+
+#ifdef DEBUG_GAMESTATE
+		for (int index = 0; index < width * height; index++)
+		{
+			double expected = get_score(unit, Bitboard::position(index));
+			bool same = expected == -DBL_MAX ? unit_scores[index] == -DBL_MAX : fabs(unit_scores[index] - expected) <= 1e-9 * max(1.0, fabs(expected));
+
+			if (!same)
+				cerr << "Score of " << Bitboard::position(index).print() << " differs: " << unit_scores[index] << " instead of " << expected << endl;
+			assert(same);
+		}
+#endif
+
+		return unit_scores;
+	}
+	// Objectives with the best total score, one unit per cell at most, solved as an assignment over the candidate cells.
+	// Whatever the other units get, a unit's objective is among its best cells as many as the units, so those are the candidates.
 	void assign_objective_to_units()
 	{
 		Stopwatch s("Assign objective to units");
 
 		units_in_order.clear();
 
-		set<shared_ptr<Unit>> units;
+		// Against a chainkill to our HQ, units on the chain hold their cell as they make it cost more, the others go for it
+		vector<Position> threat_path;
+		threat_cells.clear();
+		if (get_chainkill_threat(threat_path) >= 0)
+			threat_cells = Bitboard::from(threat_path);
+
+		vector<shared_ptr<Unit>> movers;
 		for (auto& unit : units_ally)
-			units.insert(unit);
+			if (!threat_cells.test(unit->p))
+				movers.push_back(unit);
 
-		while (units.size())
+		int count = movers.size();
+		if (!count)
+			return;
+
+		compute_score_planes();
+
+		vector<vector<double>> scores(count, vector<double>(width * height));
+		Bitboard candidates;
+		for (int k = 0; k < count; k++)
 		{
-			shared_ptr<Unit> best_unit = *units.begin();
-			Objective best_objective = Objective(-DBL_MAX);
+			const double* unit_scores = get_scores(movers[k]);
+			copy(unit_scores, unit_scores + width * height, scores[k].begin());
 
-			for (const auto& unit : units)
+			vector<int> cells;
+			for (int index = 0; index < width * height; index++)
 			{
-				Objective objective = find_target(unit);
-
-				if (objective.score > best_objective.score)
-				{
-					best_unit = unit;
-					best_objective = objective;
-				}
+				if (scores[k][index] > -DBL_MAX)
+					cells.push_back(index);
 			}
 
-			//best_unit->debug();
-			//best_objective.target.debug();
-			//cerr << endl;
+			int best = min(count, (int)cells.size());
+			partial_sort(cells.begin(), cells.begin() + best, cells.end(), [&](int a, int b) { return scores[k][a] > scores[k][b]; });
+			for (int i = 0; i < best; i++)
+				candidates.bits.set(cells[i]);
+		}
 
-			if (best_objective.score > -DBL_MAX)
-			{
-				cells_used_objective[best_objective.target.y][best_objective.target.x] = 1;
-				best_unit->set_objective(best_objective);
-				units_in_order.push_back(best_unit);
-			}
+		// Pairs without a score cost more than any assignment made of pairs with one
+		vector<int> cells;
+		for (int index = 0; index < width * height; index++)
+			if (candidates.bits.test(index))
+				cells.push_back(index);
+
+		const double forbidden = 1e9;
+		vector<vector<double>> cost(count, vector<double>(max(count, (int)cells.size()), forbidden));
+		for (int k = 0; k < count; k++)
+			for (int c = 0; c < (int)cells.size(); c++)
+				if (scores[k][cells[c]] > -DBL_MAX)
+					cost[k][c] = -scores[k][cells[c]];
+
+		vector<int> assignment = solve_assignment(cost);
+
+		// Best objectives move first, as when they were picked one at a time
+		vector<pair<double, int>> assigned;
+		for (int k = 0; k < count; k++)
+			if (assignment[k] >= 0 && assignment[k] < (int)cells.size() && scores[k][cells[assignment[k]]] > -DBL_MAX)
+				assigned.push_back(make_pair(scores[k][cells[assignment[k]]], k));
+		stable_sort(assigned.begin(), assigned.end(), [](const pair<double, int>& a, const pair<double, int>& b) { return a.first > b.first; });
+
+		for (auto& unit_score : assigned)
+		{
+			shared_ptr<Unit> unit = movers[unit_score.second];
+			Position target = Bitboard::position(cells[assignment[unit_score.second]]);
 
-			units.erase(best_unit);
+			cells_used_objective[target.y][target.x] = 1;
+			unit->set_objective(Objective(target, unit_score.first));
+			units_in_order.push_back(unit);
 		}
 	}
 
@@ -1650,11 +3183,18 @@ public:
 	void train_units_on_cuts()
 	{
 		Stopwatch s("Train on cuts");
+		budget.start_phase(PHASE_TRAIN_ON_CUTS);
 
 		MaxPriorityQueue<Position, double> cuts = find_cuts(true);
 
 		while (!cuts.empty())
 		{
+			if (budget.phase_expired())
+			{
+				cerr << "Train on cuts: out of time" << endl;
+				break;
+			}
+
 			Position cut = cuts.elements.top().second;
 			double gain = cuts.elements.top().first;
 			int level_required = get_cells_level_ally(cut);
@@ -1665,244 +3205,411 @@ public:
 
 			if (score > 0.0 && level_required <= 3 && can_train_level(level_required))
 			{
-				commands.push_back(Command(TRAIN, level_required, cut));
-				refresh_gamestate_for_spawn(make_shared<Unit>(Unit(cut.x, cut.y, 999, level_required, 0)), cut);
+				commands.push_back(Command(TRAIN, level_required, cut));
+				refresh_gamestate_for_spawn(make_shared<Unit>(Unit(cut.x, cut.y, 999, level_required, 0)), cut);
+			}
+
+			cuts.elements.pop();
+		}
+	}
+	MaxPriorityQueue<Position, double> find_cuts(bool find_enemies)
+	{
+		vector<Position> attainable_articulation_points = get_attainable_articulation_points(find_enemies);
+
+		MaxPriorityQueue<Position, double> scores;
+		if (attainable_articulation_points.empty())
+			return scores;
+
+		double values[width * height];
+		compute_dominated_values(find_enemies, values);
+
+		for (auto& articulation_point : attainable_articulation_points)
+			scores.put(articulation_point, values[Bitboard::index(articulation_point)]);
+
+		return scores;
+	}
+	// Value cut off from the HQ by taking each cell: the cell and everything it dominates in the territory graph rooted at the HQ,
+	// summed up the dominator tree (iterative algorithm of Cooper, Harvey and Kennedy). Cells not connected to the HQ are 0.
+	void compute_dominated_values(bool find_enemies, double values[])
+	{
+		Adjacency& adj_list = find_enemies ? adjacency_list_position_enemy : adjacency_list_position_ally;
+		int root = Bitboard::index(find_enemies ? hq_enemy->p : hq_ally->p);
+
+		// Depth first postorder from the HQ
+		int postorder[width * height];
+		int number[width * height]; // position in postorder, -1 if not reached
+		int stack[width * height];
+		int next_child[width * height];
+		int count = 0, top = 0;
+		fill(number, number + width * height, -1);
+		fill(next_child, next_child + width * height, 0);
+
+		bool seen[width * height] = {};
+		seen[root] = true;
+		stack[top++] = root;
+		while (top)
+		{
+			int u = stack[top - 1];
+			if (next_child[u] < adj_list.degree[u])
+			{
+				int v = Bitboard::index(adj_list.neighbours[u][next_child[u]++]);
+				if (!seen[v])
+				{
+					seen[v] = true;
+					stack[top++] = v;
+				}
+			}
+			else
+			{
+				number[u] = count;
+				postorder[count++] = u;
+				top--;
 			}
-
-			cuts.elements.pop();
 		}
-	}
-	MaxPriorityQueue<Position, double> find_cuts(bool find_enemies)
-	{
-		vector<Position> attainable_articulation_points = get_attainable_articulation_points(find_enemies);
-		unordered_map<Position, vector<Position>, HashPosition>& adjacency_list_positions = find_enemies ? adjacency_list_position_enemy : adjacency_list_position_ally;
 
-		//string str = "Articulation Points: ";
-		//for (auto& attainable_articulation_point : attainable_articulation_points)
-		//	str += attainable_articulation_point.print() + " ";
-		//cerr << str << endl;
+		// Immediate dominators, in reverse postorder until stable. Edges go both ways so predecessors are the neighbours.
+		int idom[width * height];
+		fill(idom, idom + width * height, -1);
+		idom[root] = root;
 
-		MaxPriorityQueue<Position, double> scores;
-		for (auto& articulation_point : attainable_articulation_points)
+		auto intersect = [&](int a, int b)
+		{
+			while (a != b)
+			{
+				while (number[a] < number[b])
+					a = idom[a];
+				while (number[b] < number[a])
+					b = idom[b];
+			}
+			return a;
+		};
+
+		bool changed = true;
+		while (changed)
 		{
-			double score = 0;
-			for (auto& neighbor : adjacency_list_positions[articulation_point])
+			changed = false;
+			for (int i = count - 2; i >= 0; i--)
 			{
-				vector<Position> graph = find_graph_from_source(neighbor, articulation_point, find_enemies);
-				score += score_graph(graph);
+				int u = postorder[i];
+				int new_idom = -1;
+				for (int k = 0; k < adj_list.degree[u]; k++)
+				{
+					int v = Bitboard::index(adj_list.neighbours[u][k]);
+					if (idom[v] >= 0)
+						new_idom = new_idom < 0 ? v : intersect(v, new_idom);
+				}
 
-				//string string1 = "graph: ";
-				//for (auto& pos : graph)
-				//	string1 += pos.print() + ", ";
-				//cerr << string1 << endl;
+				if (idom[u] != new_idom)
+				{
+					idom[u] = new_idom;
+					changed = true;
+				}
 			}
-			score += score_graph({ articulation_point });
-			scores.put(articulation_point, score);
 		}
 
-		//string string2 = "Cuts: ";
-		//while (!scores.empty())
-		//{
-		//	string2 += scores.elements.top().second.print() + ": " + to_string(scores.elements.top().first) + ", ";
-		//	scores.elements.pop();
-		//}
-		//cerr << string2;
-
-		return scores;
+		// Subtree sums, children come before their dominator in postorder
+		fill(values, values + width * height, 0.0);
+		for (int i = 0; i < count; i++)
+		{
+			int u = postorder[i];
+			values[u] += score_cell(Bitboard::position(u));
+			if (u != root)
+				values[idom[u]] += values[u];
+		}
 	}
 	double score_graph(const vector<Position>& positions)
 	{
 		double score = 0.0;
 		for (auto& position : positions)
-		{
-			Cell& cell = get_cell(position);
-
-			if (cell.is_occupied_by_unit())
-				score += cell.unit->level * 10.0;
-			else if (cell.is_occupied_by_mine())
-				score += 4.0;
-			else if (cell.is_occupied_by_tower())
-				score += 15.0;
-
-			score += 1.0;
-		}
+			score += score_cell(position);
 
 		return score;
 	}
-	vector<Position> find_graph_from_source(const Position& source, const Position& forbidden, bool find_enemies)
+	double score_graph(const Bitboard& positions)
 	{
-		unordered_map<Position, vector<Position>, HashPosition>& adj_list = find_enemies ? adjacency_list_position_enemy : adjacency_list_position_ally;
-		Position hq = find_enemies ? hq_enemy->p : hq_ally->p;
-
-		unordered_map<Position, bool, HashPosition> visited;
-		visited[source] = true;
-
-		queue<Position> frontier;
-		frontier.push(source);
-
-		vector<Position> graph;
-		graph.push_back(source);
-
-		while (!frontier.empty())
-		{
-			Position current = frontier.front();
-			frontier.pop();
+		double score = 0.0;
+		for (int index = 0; index < width * height; index++)
+			if (positions.bits.test(index))
+				score += score_cell(Bitboard::position(index));
 
-			if (current == hq)
-				return vector<Position>();
+		return score;
+	}
+	inline double score_cell(const Position& position)
+	{
+		Cell& cell = get_cell(position);
 
-			for (const Position& next : adj_list[current])
-			{
-				if (!visited.count(next) && !(next == forbidden))
-				{
-					visited[next] = true;
-					frontier.push(next);
-					graph.push_back(next);
-				}
-			}
-		}
+		double score = 1.0;
+		if (cell.is_occupied_by_unit())
+			score += cell.unit->level * 10.0;
+		else if (cell.is_occupied_by_mine())
+			score += 4.0;
+		else if (cell.is_occupied_by_tower())
+			score += 15.0;
 
-		return graph;
+		return score;
 	}
 	vector<Position> get_attainable_articulation_points(bool find_enemies)
 	{
 		vector<Position> articulation_points = get_articulation_points(find_enemies);
 		vector<Position> attainable_articulation_points;
+		Bitboard attainable = (find_enemies ? board_ally_active : board_enemy_active).dilate(1, board_passable);
 
 		for (auto& articulation_point : articulation_points)
-		{
-			if (find_enemies)
-			{
-				for (auto& position : positions_ally)
-					if (get_distance(articulation_point, position) <= 1)
-					{
-						attainable_articulation_points.push_back(articulation_point);
-						break;
-					}
-			}
-			else
-			{
-				for (auto& position : positions_enemy)
-					if (get_distance(articulation_point, position) <= 1)
-					{
-						attainable_articulation_points.push_back(articulation_point);
-						break;
-					}
-			}
-		}
+			if (attainable.test(articulation_point))
+				attainable_articulation_points.push_back(articulation_point);
 
 		return attainable_articulation_points;
 	}
 	vector<Position> get_articulation_points(bool find_enemies)
 	{
-		unordered_map<Position, bool, HashPosition> visited;
-		unordered_map<Position, int, HashPosition> disc;
-		unordered_map<Position, int, HashPosition> low;
-		unordered_map<Position, Position, HashPosition> parent;
-		unordered_map<Position, bool, HashPosition> ap;
-
-		vector<Position> positions = find_enemies ? positions_enemy : positions_ally;
-		unordered_map<Position, vector<Position>, HashPosition> adj_list = find_enemies ? adjacency_list_position_enemy : adjacency_list_position_ally;
+		bool visited[width * height] = {};
+		int disc[width * height] = {};
+		int low[width * height] = {};
+		int parent[width * height];
+		bool ap[width * height] = {};
+		fill(parent, parent + width * height, -1);
 
-		for (auto& pos : positions)
-		{
-			parent[pos] = Position(-1, -1);
-			visited[pos] = false;
-			ap[pos] = false;
-		}
+		vector<Position>& positions = find_enemies ? positions_enemy : positions_ally;
+		Adjacency& adj_list = find_enemies ? adjacency_list_position_enemy : adjacency_list_position_ally;
 
 		for (auto& pos : positions)
-			if (!visited[pos])
+			if (!visited[Bitboard::index(pos)])
 				articulation_point_inner(pos, visited, disc, low, parent, ap, adj_list);
 
 		vector<Position> articulation_points;
-		for (auto& a : ap)
-			if (a.second)
-				articulation_points.push_back(a.first);
+		for (auto& pos : positions)
+			if (ap[Bitboard::index(pos)])
+				articulation_points.push_back(pos);
 
 		return articulation_points;
 	}
 	void articulation_point_inner(
-		Position position,
-		unordered_map<Position, bool, HashPosition>& visited,
-		unordered_map<Position, int, HashPosition>& disc,
-		unordered_map<Position, int, HashPosition>& low,
-		unordered_map<Position, Position, HashPosition>& parent,
-		unordered_map<Position, bool, HashPosition>& ap,
-		unordered_map<Position, vector<Position>, HashPosition>& adjacency_list_ap
+		const Position& position,
+		bool visited[],
+		int disc[],
+		int low[],
+		int parent[],
+		bool ap[],
+		Adjacency& adjacency_list_ap
 	)
 	{
-		static int time = 0;
+		thread_local static int time = 0;
 		int children = 0; // Count of children in DFS Tree 
-		visited[position] = true;
-		disc[position] = low[position] = ++time;
+		int u = Bitboard::index(position);
+		visited[u] = true;
+		disc[u] = low[u] = ++time;
 
 		for (auto& next_position : adjacency_list_ap[position])
 		{
-			if (!visited[next_position])
+			int v = Bitboard::index(next_position);
+
+			if (!visited[v])
 			{
 				children++;
-				parent[next_position] = position;
+				parent[v] = u;
 				articulation_point_inner(next_position, visited, disc, low, parent, ap, adjacency_list_ap);
 
 				// (1) u is root of DFS tree and has two or more chilren. 
-				if (parent[position] == Position(-1, -1) && children > 1)
-					ap[position] = true;
+				if (parent[u] == -1 && children > 1)
+					ap[u] = true;
 
 				// (2) If u is not root and low value of one of its child is more than discovery value of u. 
-				if (parent[position] != Position(-1, -1) && low[next_position] >= disc[position])
-					ap[position] = true;
+				if (parent[u] != -1 && low[v] >= disc[u])
+					ap[u] = true;
 
 				// Check if the subtree rooted with next_position has a connection to one of the ancestors of position 
-				low[position] = min(low[position], low[next_position]);
+				low[u] = min(low[u], low[v]);
 			}
 			// Update low value of u for parent function calls.
-			else if (next_position != parent[position])
+			else if (v != parent[u])
 			{
-				low[position] = min(low[position], disc[next_position]);
+				low[u] = min(low[u], disc[v]);
 			}
 		}
 	}
 
-
 	// Chainkill
-	void attempt_chainkill()
+	// Cheapest chain to the enemy HQ this turn where each cell is taken either by training or, for free, by one of our units
+	// next to it stepping in, which is then executed. Depth first from the cells we can reach, pruned by our gold and by the
+	// best chain so far, with what is left to the HQ bounded below by a search where each cell costs its cheapest way.
+	bool attempt_lethal()
 	{
-		Stopwatch s("Chainkills");
+		Stopwatch s("Lethal");
+		budget.start_phase(PHASE_CHAINKILL);
+
+		LethalContext context;
+		for (auto& unit : units_ally)
+			if (context.units.size() < 64)
+				context.units.push_back(unit);
+
+		for (int index = 0; index < width * height; index++)
+		{
+			Position position = Bitboard::position(index);
+			char info = get_cell_info(position);
+			if (info == 'O')
+				context.weights[index] = -1;
+			else if (info == 'o')
+				context.weights[index] = 0;
+			else
+			{
+				int level = get_cells_level_ally(position);
+				if (get_enemy_towers_around(position))
+					level = min(level, get_cell(position).is_occupied_by_enemy_unit() ? min(get_cell(position).level_of_enemy_unit() + 1, 3) : 1);
+				for (auto& unit : context.units)
+					if (get_distance(unit->p, position) == 1 && unit->level >= level)
+						level = 0;
+				context.weights[index] = level * 10;
+			}
+		}
+
+		int came_from[width * height];
+		dijkstra_chainkill_weighted(hq_enemy->p, context.weights, context.remaining, came_from, gold_ally);
+
+		context.on_path.clear();
+		context.used = 0;
+		context.cost = 0;
+		context.nodes = 0;
+		context.expired = false;
+		context.best_cost = INT_MAX;
+		search_lethal(context);
+
+		if (context.best_cost == INT_MAX)
+			return false;
+
+		cerr << "LETHAL! cost: " << context.best_cost << endl;
+
+		for (int i = 0; i < (int)context.best_path.size(); i++)
+		{
+			Position position = context.best_path[i];
+			if (context.best_movers[i] >= 0)
+			{
+				shared_ptr<Unit> unit = context.units[context.best_movers[i]];
+				commands.push_back(Command(MOVE, unit->id, position));
+				refresh_gamestate_for_movement(unit, position);
+			}
+			else if (context.best_levels[i] > 0)
+			{
+				commands.push_back(Command(TRAIN, context.best_levels[i], position));
+				refresh_gamestate_for_spawn(make_shared<Unit>(Unit(position.x, position.y, 999, context.best_levels[i], 0)), position);
+			}
+			else
+			{
+				income_ally += (cells_info[position.y][position.x] != 'O');
+				cells_info[position.y][position.x] = 'O';
+				dirty_cells.set(position);
+				refresh_gamestate();
+			}
+		}
 
-		unordered_map<Position, double, HashPosition> chainkills = dijkstra_chainkill_all_costs(hq_enemy->p);
+		return true;
+	}
+	void search_lethal(LethalContext& context)
+	{
+		if (!context.path.empty() && context.path.back() == hq_enemy->p)
+		{
+			context.best_cost = context.cost;
+			context.best_path = context.path;
+			context.best_levels = context.levels;
+			context.best_movers = context.movers;
+			return;
+		}
 
-		if (!chainkills.size())
+		if (context.expired || ++context.nodes > LETHAL_MAX_NODES || ((context.nodes & 255) == 0 && budget.phase_expired()))
+		{
+			context.expired = true;
 			return;
+		}
 
-		//for (auto& t : chainkills)
-		//{
-		//	string s1 = "";
-		//	s1 += t.first.print() + ": " + to_string(t.second);
-		//	cerr << s1 << endl;
-		//}
+		// The chain starts next to our territory, then goes on cells we do not hold, the most promising first
+		vector<Position> children;
+		if (context.path.empty())
+		{
+			for (auto& position : board_ally_active.neighbours().to_positions())
+				if (context.remaining[Bitboard::index(position)] >= 0)
+					children.push_back(position);
+		}
+		else
+			for (auto& position : adjacency_list[context.path.back()])
+				if (context.remaining[Bitboard::index(position)] >= 0 && !context.on_path.test(position))
+					children.push_back(position);
+
+		stable_sort(children.begin(), children.end(), [&](const Position& a, const Position& b) { return context.remaining[Bitboard::index(a)] < context.remaining[Bitboard::index(b)]; });
+
+		for (auto& child : children)
+		{
+			int rest = context.remaining[Bitboard::index(child)] - context.weights[Bitboard::index(child)];
+
+			context.path.push_back(child);
+			context.on_path.set(child);
+			int level = get_cut_step_level(context.path, context.path.size() - 1, true);
+			context.levels.push_back(level);
+
+			// Our units next to the cell step in for free, else we train
+			for (int k = 0; k < (int)context.units.size(); k++)
+			{
+				shared_ptr<Unit>& unit = context.units[k];
+				if (level == 0 || (context.used >> k & 1) || unit->level < level || get_distance(unit->p, child) != 1)
+					continue;
+				if (context.cost + rest > gold_ally || context.cost + rest >= context.best_cost)
+					break;
+
+				context.used |= 1ull << k;
+				context.movers.push_back(k);
+				search_lethal(context);
+				context.movers.pop_back();
+				context.used &= ~(1ull << k);
+			}
 
-		double chainkill_cost = DBL_MAX;
+			int cost = context.cost + level * 10;
+			if (cost + rest <= gold_ally && cost + rest < context.best_cost)
+			{
+				swap(cost, context.cost);
+				context.movers.push_back(-1);
+				search_lethal(context);
+				context.movers.pop_back();
+				swap(cost, context.cost);
+			}
+
+			context.levels.pop_back();
+			context.on_path.reset(child);
+			context.path.pop_back();
+		}
+	}
+	void attempt_chainkill()
+	{
+		Stopwatch s("Chainkills");
+		budget.start_phase(PHASE_CHAINKILL);
+
+		int cost[width * height];
+		int came_from[width * height];
+		dijkstra_chainkill(hq_enemy->p, cost, came_from, true, INT_MAX);
+
+		int chainkill_cost = INT_MAX;
 		Position chainkill_start;
-		for (auto& position : chainkills)
+		for (int index = 0; index < width * height; index++)
 		{
-			if (position.second < chainkill_cost && is_position_attainable(position.first))
+			if (cost[index] >= 0 && cost[index] < chainkill_cost && is_position_attainable(Bitboard::position(index)))
 			{
-				chainkill_cost = position.second;
-				chainkill_start = position.first;
+				chainkill_cost = cost[index];
+				chainkill_start = Bitboard::position(index);
 			}
 		}
 
+		if (chainkill_cost == INT_MAX)
+			return;
+
 		cerr << "Chainkill start: " << chainkill_start.print() << " cost: " << chainkill_cost << endl;
 
 		if (chainkill_cost <= gold_ally)
 		{
-			vector<Position> chainkill_path = dijkstra_chainkill_path(chainkill_start, hq_enemy->p);
-
-			//string s1;
-			//for (auto& t : chainkill_path)
-			//	s1 += t.print() + ", ";
-			//cerr << s1 << endl;
+			// The tree leads from each cell to the HQ, which is the order the cells are taken in
+			vector<Position> chainkill_path;
+			for (int index = Bitboard::index(chainkill_start); ; index = came_from[index])
+			{
+				chainkill_path.push_back(Bitboard::position(index));
+				if (came_from[index] == index)
+					break;
+			}
 
 			double score = get_cut_cost(chainkill_path, true);
 
@@ -1914,103 +3621,161 @@ public:
 			cerr << "WILL CHAINKILL!" << endl;
 		}
 	}
-	unordered_map<Position, double, HashPosition> dijkstra_chainkill_all_costs(const Position& source)
+	// Cheapest gold to take every cell and chain from it to source, and the next cell on the way there, -1 if out of reach.
+	// Cells cost 10 gold per level needed, so a queue of buckets by cost / 10 replaces the priority queue (Dial's algorithm),
+	// and as steps cost at most 3 buckets only 4 of them are live at once. Cells costing more than limit are left out of reach.
+	void dijkstra_chainkill(const Position& source, int cost[], int came_from[], bool my_pov, int limit)
 	{
-		MinPriorityQueue<Position, double> frontier;
-		frontier.put(source, 0.0);
-
-		unordered_map<Position, double, HashPosition> cost_so_far;
-		cost_so_far[source] = 10.0;
+		char own_active = my_pov ? 'O' : 'X';
+		char own_inactive = my_pov ? 'o' : 'x';
+		int (&cells_level)[width][height] = my_pov ? cells_level_ally : cells_level_enemy;
 
-		while (!frontier.empty())
+		int weights[width * height];
+		for (int index = 0; index < width * height; index++)
 		{
-			Position current = frontier.pop();
-
-			for (const Position& next : get_adjacency_list(current))
-				if (get_cell_info(next) != 'O')
-				{
-					double new_cost = cost_so_far[current] + get_cells_level_ally(next) * 10.0 * (get_cell_info(next) != 'o');
-
-					if ((cost_so_far.find(next) == cost_so_far.end()) || (new_cost < cost_so_far[next]))
-					{
-						cost_so_far[next] = new_cost;
-						frontier.put(next, new_cost);
-					}
-				}
+			Position position = Bitboard::position(index);
+			char info = get_cell_info(position);
+			weights[index] = info == own_active ? -1 : (info == own_inactive ? 0 : cells_level[position.y][position.x] * 10);
 		}
 
-		return cost_so_far;
+		dijkstra_chainkill_weighted(source, weights, cost, came_from, limit);
 	}
-	vector<Position> dijkstra_chainkill_path(const Position& source, const Position& target)
+	// Same with the gold to take each cell given, in multiples of 10 up to 30, -1 for the cells that cannot be taken
+	void dijkstra_chainkill_weighted(const Position& source, const int weights[], int cost[], int came_from[], int limit)
 	{
-		MinPriorityQueue<Position, double> frontier;
-		frontier.put(source, 0.0);
+		fill(cost, cost + width * height, -1);
+		fill(came_from, came_from + width * height, -1);
 
-		unordered_map<Position, double, HashPosition> cost_so_far;
-		cost_so_far[source] = 10.0;
+		int buckets[4][width * height];
+		int sizes[4] = {};
 
-		unordered_map<Position, Position, HashPosition> came_from;
-		came_from[source] = source;
+		int source_index = Bitboard::index(source);
+		cost[source_index] = weights[source_index];
+		came_from[source_index] = source_index;
+		buckets[(cost[source_index] / 10) % 4][sizes[(cost[source_index] / 10) % 4]++] = source_index;
+		int pending = 1;
 
-		while (!frontier.empty())
+		for (int bucket = cost[source_index] / 10; pending && bucket * 10 <= limit; bucket++)
 		{
-			Position current = frontier.pop();
+			int* queue = buckets[bucket % 4];
+			int& size = sizes[bucket % 4];
 
-			for (const Position& next : get_adjacency_list(current))
-				if (get_cell_info(next) != 'O')
-				{
-					double new_cost = cost_so_far[current] + get_cells_level_ally(next) * 10.0 * (get_cell_info(next) != 'o');
+			// Free steps append to the bucket being read
+			for (int k = 0; k < size; k++)
+			{
+				int current = queue[k];
+				pending--;
+				if (cost[current] != bucket * 10)
+					continue;
 
-					if ((cost_so_far.find(next) == cost_so_far.end()) || (new_cost < cost_so_far[next]))
+				for (const Position& next : adjacency_list[Bitboard::position(current)])
+					if (weights[Bitboard::index(next)] >= 0)
 					{
-						cost_so_far[next] = new_cost;
-						frontier.put(next, new_cost);
-						came_from[next] = current;
+						int next_index = Bitboard::index(next);
+						int new_cost = cost[current] + weights[next_index];
+
+						if (cost[next_index] < 0 || new_cost < cost[next_index])
+						{
+							cost[next_index] = new_cost;
+							came_from[next_index] = current;
+							buckets[(new_cost / 10) % 4][sizes[(new_cost / 10) % 4]++] = next_index;
+							pending++;
+						}
 					}
-				}
+			}
+			size = 0;
 		}
 
-		return reconstruct_path(source, target, came_from);
+		for (int index = 0; index < width * height; index++)
+			if (cost[index] > limit)
+				cost[index] = came_from[index] = -1;
 	}
-	inline double get_cut_cost(const vector<Position> cut, bool my_pov)
+	// Least gold the enemy can kill our HQ with this turn through a chain of trainings, and the chain, -1 if they cannot.
+	// Only the cells within their gold and next to them matter, so the search is bounded by their gold and reused until one
+	// of those cells changes: then the threat can be checked again after each of our actions.
+	int get_chainkill_threat(vector<Position>& path)
 	{
-		double cost = 0.0;
-
-		if (my_pov)
+		if ((threat_dirty & threat_region).any())
 		{
-			bool just_captured_tower = false;
-			for (auto& position : cut)
-				if (get_cell_info(position) != 'o')
-				{
-					if (just_captured_tower && get_enemy_towers_around(position) == 1)
-						cost += get_cell(position).is_occupied_by_enemy_unit() ? min(get_cell(position).level_of_enemy_unit() + 1, 3) * 10.0 : 10.0;
-					else
-						cost += get_cells_level_ally(position) * 10.0;
-
-					just_captured_tower = get_cell(position).is_occupied_by_enemy_tower();
-				}
-				else
-					just_captured_tower = false;
+			dijkstra_chainkill(hq_ally->p, threat_cost, threat_came_from, false, gold_enemy + income_enemy);
+
+			threat_region.clear();
+			for (int index = 0; index < width * height; index++)
+				if (threat_cost[index] >= 0)
+					threat_region.bits.set(index);
+			threat_region = threat_region.dilate();
+			threat_dirty.clear();
 		}
+#ifdef DEBUG_GAMESTATE
 		else
 		{
-			bool just_captured_tower = false;
-			for (auto& position : cut)
-				if (get_cell_info(position) != 'x')
-				{
-					if (just_captured_tower && get_ally_towers_around(position) == 1)
-						cost += get_cell(position).is_occupied_by_ally_unit() ? min(get_cell(position).level_of_ally_unit() + 1, 3) * 10.0 : 10.0;
-					else
-						cost += get_cells_level_enemy(position) * 10.0;
+			int cost[width * height];
+			int came_from[width * height];
+			dijkstra_chainkill(hq_ally->p, cost, came_from, false, gold_enemy + income_enemy);
+			bool same = equal(cost, cost + width * height, threat_cost);
+
+			if (!same)
+				cerr << "Reused chainkill threat differs from a new search" << endl;
+			assert(same);
+		}
+#endif
 
-					just_captured_tower = get_cell(position).is_occupied_by_ally_tower();
-				}
-				else
-					just_captured_tower = false;
+		Bitboard attainable = board_enemy_active.dilate(1, board_passable);
+		int threat = -1;
+		int start = -1;
+		for (int index = 0; index < width * height; index++)
+			if (threat_cost[index] >= 0 && (threat < 0 || threat_cost[index] < threat) && attainable.bits.test(index))
+			{
+				threat = threat_cost[index];
+				start = index;
+			}
+
+		path.clear();
+		for (int index = start; index >= 0; index = threat_came_from[index])
+		{
+			path.push_back(Bitboard::position(index));
+			if (threat_came_from[index] == index)
+				break;
 		}
 
+		return threat;
+	}
+	inline double get_cut_cost(const vector<Position>& cut, bool my_pov)
+	{
+		double cost = 0.0;
+		for (int i = 0; i < (int)cut.size(); i++)
+			cost += get_cut_step_cost(cut, i, my_pov);
+
 		return cost;
 	}
+	// Cost and level of taking cut[i] after the cells before it: next to a tower just captured, the cell only needs to beat its unit
+	inline double get_cut_step_cost(const vector<Position>& cut, int i, bool my_pov) { return get_cut_step_level(cut, i, my_pov) * 10.0; }
+	inline int get_cut_step_level(const vector<Position>& cut, int i, bool my_pov)
+	{
+		char own_inactive = my_pov ? 'o' : 'x';
+		const Position& position = cut[i];
+		if (get_cell_info(position) == own_inactive)
+			return 0;
+
+		bool just_captured_tower = false;
+		if (i > 0 && get_cell_info(cut[i - 1]) != own_inactive)
+			just_captured_tower = my_pov ? get_cell(cut[i - 1]).is_occupied_by_enemy_tower() : get_cell(cut[i - 1]).is_occupied_by_ally_tower();
+
+		if (my_pov)
+		{
+			if (just_captured_tower && get_enemy_towers_around(position) == 1)
+				return get_cell(position).is_occupied_by_enemy_unit() ? min(get_cell(position).level_of_enemy_unit() + 1, 3) : 1;
+			else
+				return get_cells_level_ally(position);
+		}
+		else
+		{
+			if (just_captured_tower && get_ally_towers_around(position) == 1)
+				return get_cell(position).is_occupied_by_ally_unit() ? min(get_cell(position).level_of_ally_unit() + 1, 3) : 1;
+			else
+				return get_cells_level_enemy(position);
+		}
+	}
 	void execute_cut(const vector<Position>& cut)
 	{
 		bool just_captured_tower = false;
@@ -2033,117 +3798,384 @@ public:
 			{
 				income_ally += (cells_info[position.y][position.x] != 'O');
 				cells_info[position.y][position.x] = 'O';
-				update_gamestate();
+				dirty_cells.set(position);
+				refresh_gamestate();
 			}
 		}
 	}
 
 
 	// Distances
-	void floyd_warshall()
+	void compute_distances(const Bitboard& passable)
 	{
 		Stopwatch s("All distance");
 
-		const int dim = width * height;
+		for (int source = 0; source < width * height; source++)
+			compute_distances_from(source, passable);
+
+		for (int radius = 0; radius < 4; radius++)
+			stencils[radius].build(distances, radius);
+	}
+	void compute_distances_from(int source, const Bitboard& passable)
+	{
+		::compute_distances_from(distances[source], source, passable);
+	}
+
+	// Simulation
+	void search_cuts()
+	{
+		Stopwatch s("Find cuts");
+		budget.start_phase(PHASE_CUTS);
+
+		// One search and one selection, and a second search only when the selection left gold that the cuts it passed over
+		// could use: the cuts made since may have opened new ones there
+		for (int pass = 0; pass < 2; pass++)
+		{
+			if (budget.phase_expired())
+			{
+				cerr << "Cuts: out of time" << endl;
+				return;
+			}
+
+			compute_adjacency_list_enemy_for_cut();
+
+			vector<pair<vector<Position>, double>> cuts;
+			for (auto& position : get_frontier_spawn_ally(1))
+			{
+				if (budget.phase_expired())
+					break;
+
+				auto pair = search({ position }, 8, true);
+
+				if (pair.first > 0.0)
+					cuts.push_back(make_pair(pair.second, pair.first));
+			}
+
+			for (auto& cut : find_flow_cuts())
+			{
+				double score = score_cut(cut, Bitboard::from(cut), true);
+
+				if (score > 0.0)
+					cuts.push_back(make_pair(cut, score));
+			}
+
+			for (auto& t : cuts)
+			{
+				string s1 = "";
+				for (auto& p : t.first)
+					s1 += p.print() + ", ";
+				cerr << "Chain: " << s1 << "Score: " << t.second << " Cost:" << get_cut_cost(t.first, true) << endl;
+			}
+
+			// The selected cuts share no cells nor what they cut off, so their gains add up, and their total cost is within our
+			// gold when selected. Making one can still change the others' cost, so each is checked again against the gold left.
+			vector<int> selected = select_cuts(cuts);
+			bool executed = false;
+			for (auto& index : selected)
+			{
+				vector<Position>& positions = cuts[index].first;
+				double cost = get_cut_cost(positions, true);
+				if (cost > (double)gold_ally)
+					continue;
+
+				string s1 = "";
+				for (auto& t : positions)
+					s1 += t.print() + ", ";
+				cerr << "CUTTING! " << s1 << "Score: " << cuts[index].second << " Cost:" << cost << endl;
+
+				execute_cut(positions);
+				executed = true;
+			}
+
+			double cheapest_left = DBL_MAX;
+			for (int index = 0; index < cuts.size(); index++)
+				if (find(selected.begin(), selected.end(), index) == selected.end())
+					cheapest_left = min(cheapest_left, get_cut_cost(cuts[index].first, true));
+
+			if (!executed || gold_ally < cheapest_left)
+				return;
+		}
+	}
+	// Indices of the cuts to make this turn, by decreasing score: the set with the best total score that our gold affords,
+	// among the sets whose cuts are compatible, i.e. neither their cells nor what they cut off overlap so that their scores add up.
+	// Exact by branch and bound over the best CUT_SELECTION_SIZE cuts.
+	vector<int> select_cuts(const vector<pair<vector<Position>, double>>& cuts)
+	{
+		vector<int> order(cuts.size());
+		iota(order.begin(), order.end(), 0);
+		stable_sort(order.begin(), order.end(), [&](int a, int b) { return cuts[a].second > cuts[b].second; });
+		if (order.size() > CUT_SELECTION_SIZE)
+			order.resize(CUT_SELECTION_SIZE);
+
+		int count = order.size();
+		vector<double> costs(count), scores(count), remaining(count + 1, 0.0);
+		vector<Bitboard> taken(count);
+		for (int k = 0; k < count; k++)
+		{
+			const vector<Position>& cut = cuts[order[k]].first;
+			Bitboard cells = Bitboard::from(cut);
+			costs[k] = get_cut_cost(cut, true);
+			scores[k] = cuts[order[k]].second;
+			taken[k] = (board_enemy_active - get_tree_from_hq(cells, true)) | cells;
+		}
+		for (int k = count - 1; k >= 0; k--)
+			remaining[k] = remaining[k + 1] + scores[k];
+
+		vector<int> chosen, best_chosen;
+		double best_score = 0.0;
+		function<void(int, double, double, const Bitboard&)> select = [&](int k, double gold, double score, const Bitboard& used)
+		{
+			if (score > best_score)
+			{
+				best_score = score;
+				best_chosen = chosen;
+			}
+
+			if (k == count || score + remaining[k] <= best_score)
+				return;
 
-		for (int i = 0; i < dim; i++)
-			for (int j = 0; j < dim; j++)
+			if (costs[k] <= gold && !(taken[k] & used).any())
 			{
-				Position pos1 = Position(i % width, i / width);
-				Position pos2 = Position(j % width, j / width);
+				chosen.push_back(order[k]);
+				select(k + 1, gold - costs[k], score + scores[k], used | taken[k]);
+				chosen.pop_back();
+			}
+			select(k + 1, gold, score, used);
+		};
+		select(0, (double)gold_ally, 0.0, Bitboard());
+
+		return best_chosen;
+	}
+	// Cuts that are not chains: for each enemy unit and building, the cheapest set of cells isolating it from the enemy HQ
+	vector<vector<Position>> find_flow_cuts()
+	{
+		vector<Position> targets;
+		for (auto& unit : units_enemy)
+			targets.push_back(unit->p);
+		for (auto& building : buildings_enemy)
+			if (building->t != HQ)
+				targets.push_back(building->p);
+
+		vector<vector<Position>> cuts;
+		vector<Bitboard> found;
+		for (auto& target : targets)
+		{
+			if (budget.phase_expired())
+				break;
 
-				int distance = INT_MAX;
-				if (Position::distance(pos1, pos2) == 1 && get_cell_info(pos1) != '#' && get_cell_info(pos2) != '#')
-					distance = 1;
-				else if (Position::distance(pos1, pos2) == 0)
-					distance = 0;
+			vector<Position> cut = find_min_cost_cut(Bitboard::from(target), gold_ally);
+			Bitboard cells = Bitboard::from(cut);
 
-				distances[i][j] = distance;
+			if (!cut.empty() && find(found.begin(), found.end(), cells) == found.end())
+			{
+				found.push_back(cells);
+				cuts.push_back(cut);
 			}
+		}
 
-		for (int k = 0; k < dim; ++k)
-			for (int i = 0; i < dim; ++i)
-				for (int j = 0; j <= i; ++j)
-					if (distances[i][k] != INT_MAX && distances[k][j] != INT_MAX && distances[i][k] + distances[k][j] < distances[i][j])
-						distances[j][i] = distances[i][j] = distances[i][k] + distances[k][j];
+		return cuts;
+	}
+	// Cheapest set of enemy cells whose capture separates region from the enemy HQ, in an order we can train on them.
+	// Node split max flow: each enemy cell is an in node and an out node joined by its get_cut_cost. Only cells next to our
+	// territory can be cut, cutting deeper would need the cells in between. Empty if the cut costs more than gold_limit.
+	vector<Position> find_min_cost_cut(const Bitboard& region, int gold_limit)
+	{
+		const int infinite = 1 << 20;
+		const int source = 2 * width * height;
+		const int sink = source + 1;
+		const Bitboard& territory = board_enemy_active;
+		Bitboard attainable = board_ally_active.neighbours();
+		int hq = Bitboard::index(hq_enemy->p);
+
+		if ((region & territory).none() || region.bits.test(hq))
+			return vector<Position>();
+
+		cut_flow.clear(sink + 1);
+		for (auto& position : territory.to_positions())
+		{
+			int cell = Bitboard::index(position);
+			bool uncuttable = cell == hq || region.bits.test(cell) || !attainable.bits.test(cell);
 
-		//cerr << "Distances" << endl;
+			cut_flow.add_edge(2 * cell, 2 * cell + 1, uncuttable ? infinite : (int)get_cut_cost({ position }, true));
+			for (auto& neighbour : adjacency_list_position_enemy[position])
+				cut_flow.add_edge(2 * cell + 1, 2 * Bitboard::index(neighbour), infinite);
 
-		//for (auto& row : distances)
-		//{
-		//	for (auto& cell : row)
-		//		cerr << ((cell < INT_MAX) ? to_string(cell) : "#") << " ";
+			if (region.bits.test(cell))
+				cut_flow.add_edge(2 * cell + 1, sink, infinite);
+		}
+		cut_flow.add_edge(source, 2 * hq, infinite);
 
-		//	cerr << endl;
-		//}
-	}
+		int cost = cut_flow.run(source, sink, gold_limit);
+		if (cost == 0 || cost > gold_limit)
+			return vector<Position>();
 
+		vector<Position> cut;
+		for (auto& position : territory.to_positions())
+		{
+			int cell = Bitboard::index(position);
+			if (cut_flow.level[2 * cell] >= 0 && cut_flow.level[2 * cell + 1] < 0)
+				cut.push_back(position);
+		}
 
-	// Simulation
-	void search_cuts()
+		return cut;
+	}
+	// Best chain of up to depth more cells grown from forbidden.back(), the first best one in depth first order.
+	// Branch and bound: the cost of a chain only grows as it is extended and it gains at most the territory plus the cells
+	// it takes outside of it, so branches over the gold or unable to beat the best chain are not extended.
+	// Children are tried by the value they cut off alone, so that good chains are found early.
+	pair<double, vector<Position>> search(const vector<Position>& forbidden, int depth, bool my_pov)
 	{
-		Stopwatch s("Find cuts");
+		auto& adj_list = my_pov ? adjacency_list_position_enemy_for_cut : adjacency_list_position_ally_for_cut;
 
-		bool need_refresh = true;
-		unordered_map<shared_ptr<vector<Position>>, double> cuts;
-		while (true)
+		CutSearchContext context;
+		context.path = forbidden;
+		context.path.reserve(forbidden.size() + depth);
+		context.on_path = Bitboard::from(forbidden);
+		context.hash = cut_table.hash(context.on_path, my_pov);
+		context.my_pov = my_pov;
+		context.territory = my_pov ? board_enemy_active : board_ally_active;
+		context.gold = my_pov ? gold_ally : gold_enemy + income_enemy;
+		context.cost = get_cut_cost(forbidden, my_pov);
+		context.gain_bound = score_graph(context.territory) + score_graph(context.on_path - context.territory);
+		context.outside_value = 0.0;
+		for (int index = 0; index < width * height; index++)
+			if (adj_list.degree[index] && !context.territory.bits.test(index))
+				context.outside_value = max(context.outside_value, score_cell(Bitboard::position(index)));
+		compute_dominated_values(my_pov, context.values);
+		context.nodes = 0;
+		context.expired = false;
+		context.best = make_pair(-DBL_MAX, vector<Position>());
+
+		search_inner(context, depth);
+
+#ifdef DEBUG_CUT_SEARCH
+		if (!context.expired)
+			check_search(forbidden, depth, my_pov, context.best);
+#endif
+		return context.best;
+	}
+	void search_inner(CutSearchContext& context, int depth)
+	{
+		double score = score_cut(context.on_path, context.hash, context.cost, context.my_pov);
+		if (context.best.second.empty() || score > context.best.first)
 		{
-			if (need_refresh)
-			{
-				compute_adjacency_list_enemy_for_cut();
+			context.best.first = score;
+			context.best.second = context.path;
+		}
 
-				cuts.clear();
-				for (auto& position : get_frontier_spawn_ally(1))
-				{
-					auto pair = search({ position }, 5, true);
+		if (depth <= 0 || context.expired)
+			return;
 
-					if (pair.first > 0.0)
-						cuts.emplace(make_shared<vector<Position>>(pair.second), pair.first);
-				}
+		if ((++context.nodes & 255) == 0 && budget.phase_expired())
+		{
+			context.expired = true;
+			return;
+		}
 
-				need_refresh = false;
+		// Children by decreasing value cut off alone, ties in adjacency order
+		auto& adj_list = context.my_pov ? adjacency_list_position_enemy_for_cut : adjacency_list_position_ally_for_cut;
+		Position children[4];
+		int count = 0;
+		for (auto& child : adj_list[context.path.back()])
+			if (!context.on_path.test(child))
+			{
+				int k = count++;
+				for (; k > 0 && context.values[Bitboard::index(children[k - 1])] < context.values[Bitboard::index(child)]; k--)
+					children[k] = children[k - 1];
+				children[k] = child;
 			}
 
-			if (cuts.empty())
-				return;
+		double cost = context.cost;
+		double gain_bound = context.gain_bound;
+		for (int k = 0; k < count; k++)
+		{
+			Position child = children[k];
+			context.path.push_back(child);
 
-			auto best_cut = max_element(cuts.begin(), cuts.end(), [](const pair<shared_ptr<vector<Position>>, double>& p1, const pair<shared_ptr<vector<Position>>, double>& p2) { return p1.second < p2.second; });
-			vector<Position> positions = *(best_cut->first);
-			double score = best_cut->second;
-			double cost = get_cut_cost(positions, true);
+			context.cost = cost + get_cut_step_cost(context.path, context.path.size() - 1, context.my_pov);
+			context.gain_bound = gain_bound + (context.territory.test(child) ? 0.0 : score_cell(child));
 
-			for (auto& t : cuts)
+			if (context.cost <= context.gold && context.gain_bound + (depth - 1) * context.outside_value - context.cost > context.best.first)
 			{
-				string s1 = "";
-				for (auto& p : *(t.first))
-					s1 += p.print() + ", ";
-				cerr << "Chain: " << s1 << "Score: " << t.second << " Cost:" << get_cut_cost(*(t.first), true) << endl;
+				context.on_path.set(child);
+				context.hash ^= cut_table.key(child, context.my_pov);
+				search_inner(context, depth - 1);
+				context.hash ^= cut_table.key(child, context.my_pov);
+				context.on_path.reset(child);
 			}
 
-			if (score < 0.0)
-				return;
+			context.path.pop_back();
+		}
+		context.cost = cost;
+		context.gain_bound = gain_bound;
+	}
+	double score_cut(const vector<Position>& forbidden, const Bitboard& forbidden_cells, bool my_pov)
+	{
+		return score_cut(forbidden_cells, cut_table.hash(forbidden_cells, my_pov), get_cut_cost(forbidden, my_pov), my_pov);
+	}
+	// The gain only depends on the set of cells, not on their order, so it is looked up in the cut table by the hash of the set
+	double score_cut(const Bitboard& forbidden_cells, uint64_t hash, double cut_cost, bool my_pov)
+	{
+		if (cut_cost > (my_pov ? gold_ally : gold_enemy + income_enemy))
+			return -DBL_MAX;
 
-			if (cost <= (double)gold_ally)
-			{
-				string s1 = "";
-				for (auto& t : positions)
-					s1 += t.print() + ", ";
-				cerr << "CUTTING! " << s1 << "Score: " << score << " Cost:" << cost << endl;
+		double gain;
+		if (!cut_table.probe(hash, gain))
+		{
+			gain = get_cut_gain(forbidden_cells, my_pov);
+			cut_table.store(hash, gain);
+		}
 
-				execute_cut(positions);
-				need_refresh = true;
-			}
+		return gain == -DBL_MAX ? -DBL_MAX : gain - cut_cost;
+	}
+	// What taking the cells gains: the cells themselves and what they cut off from the HQ, -DBL_MAX if nothing is cut off
+	double get_cut_gain(const Bitboard& forbidden_cells, bool my_pov)
+	{
+		const Bitboard& territory = my_pov ? board_enemy_active : board_ally_active;
+		Bitboard tree_from_hq = get_tree_from_hq(forbidden_cells, my_pov);
 
-			cuts.erase(best_cut);
+		// The HQ is counted even once captured, as the former BFS did
+		if (tree_from_hq.count() != territory.count())
+			return score_graph(territory - tree_from_hq - forbidden_cells) + score_graph(forbidden_cells);
+		else
+			return -DBL_MAX;
+	}
+	// What stays connected to the HQ once the cells are taken: its territory without them, plus the taken cells reached from there
+	Bitboard get_tree_from_hq(const Bitboard& forbidden_cells, bool my_pov)
+	{
+		const Bitboard& territory = my_pov ? board_enemy_active : board_ally_active;
+		Bitboard hq = Bitboard::from(my_pov ? hq_enemy->p : hq_ally->p);
+		Bitboard forbidden_territory = forbidden_cells & territory;
+		Bitboard tree_from_hq = hq;
+		if ((hq & forbidden_cells).any())
+			tree_from_hq |= hq.flood_fill(forbidden_territory);
+		else
+		{
+			Bitboard connected = hq.flood_fill(territory - forbidden_cells);
+			tree_from_hq |= connected | (connected.neighbours() & forbidden_territory).flood_fill(forbidden_territory);
 		}
+
+		return tree_from_hq;
 	}
-	pair<double, vector<Position>> search(const vector<Position>& forbidden, int depth, bool my_pov)
+#ifdef DEBUG_CUT_SEARCH
+	// Runs the former exhaustive search next to search and asserts they found a cut with the same score.
+	// Children are ordered differently, so among equal cuts another one may be found.
+	void check_search(const vector<Position>& forbidden, int depth, bool my_pov, const pair<double, vector<Position>>& result)
+	{
+		auto reference = search_reference(forbidden, depth, my_pov);
+		bool same = reference.first == result.first && score_cut_reference(result.second, my_pov) == result.first;
+
+		if (!same)
+			cerr << "Cut search differs from the reference search" << endl;
+		assert(same);
+	}
+	pair<double, vector<Position>> search_reference(const vector<Position>& forbidden, int depth, bool my_pov)
 	{
 		auto& adj_list = my_pov ? adjacency_list_position_enemy_for_cut : adjacency_list_position_ally_for_cut;
 
 		if (depth > 0)
 		{
-			double max_score = score_cut(forbidden, my_pov);
+			double max_score = score_cut_reference(forbidden, my_pov);
 			vector<Position> max_cut = forbidden;
 
 			for (auto& child : adj_list[forbidden.back()])
@@ -2152,7 +4184,7 @@ public:
 					vector<Position> new_forbidden = forbidden;
 					new_forbidden.push_back(child);
 
-					auto pair = search(new_forbidden, depth - 1, my_pov);
+					auto pair = search_reference(new_forbidden, depth - 1, my_pov);
 
 					if (pair.first > max_score)
 					{
@@ -2164,13 +4196,10 @@ public:
 			return make_pair(max_score, max_cut);
 		}
 		else
-			return make_pair(score_cut(forbidden, my_pov), forbidden);
+			return make_pair(score_cut_reference(forbidden, my_pov), forbidden);
 	}
-	double score_cut(const vector<Position>& forbidden, bool my_pov)
+	double score_cut_reference(const vector<Position>& forbidden, bool my_pov)
 	{
-		if (!is_valid_cut(forbidden))
-			return -DBL_MAX;
-
 		double cut_cost = get_cut_cost(forbidden, my_pov);
 
 		if (cut_cost > (my_pov ? gold_ally : gold_enemy + income_enemy))
@@ -2296,78 +4325,10 @@ public:
 
 		return graph;
 	}
-	bool is_valid_cut(const vector<Position>& forbidden)
-	{
-		for (auto& pos1 : forbidden)
-		{
-			bool adjacent_exists = false;
-			for (auto& pos2 : forbidden)
-				if (Position::distance(pos1, pos2) <= 1)
-				{
-					adjacent_exists = true;
-					break;
-				}
-
-			if (!adjacent_exists)
-				return false;
-		}
-		return true;
-	}
-	bool find_path_to_destination(const Position& source, const Position& destination)
-	{
-		bool visited[width][height] = {};
-		visited[source.y][source.x] = true;
-
-		queue<Position> frontier;
-		frontier.push(source);
-
-		while (!frontier.empty())
-		{
-			Position current = frontier.front();
-			frontier.pop();
-
-			for (const Position& next : adjacency_list_position_enemy[current])
-			{
-				if (next == destination)
-					return true;
-
-				if (!visited[next.y][next.x])
-				{
-					visited[next.y][next.x] = true;
-					frontier.push(next);
-				}
-			}
-		}
-
-		return false;
-	}
+#endif
 
 
 	// Brute force first moves
-	pair<Position, Position> get_random_starting_position(const Individual& parent1, const Individual& parent2, const vector<Position>& available_starting_positions, const unordered_map<Position, vector<Position>, HashPosition>& spawnable_positions)
-	{
-		Position unit1_starting_position;
-		Position unit2_starting_position;
-
-		float p = (rand() % 100) / 100.0;
-		if (p < 0.4)
-		{
-			unit1_starting_position = parent1.unit1_starting_position;
-			unit2_starting_position = parent1.unit2_starting_position;
-		}
-		else if (p < 0.8)
-		{
-			unit1_starting_position = parent2.unit1_starting_position;
-			unit2_starting_position = parent2.unit2_starting_position;
-		}
-		else
-		{
-			unit1_starting_position = available_starting_positions[rand() % available_starting_positions.size()];
-			unit2_starting_position = spawnable_positions.at(unit1_starting_position)[rand() % spawnable_positions.at(unit1_starting_position).size()];
-		}
-
-		return make_pair(unit1_starting_position, unit2_starting_position);
-	}
 	vector<Position> spawnable_positions_around(const Position& position)
 	{
 		vector<Position> positions;
@@ -2408,33 +4369,33 @@ public:
 			break;
 		}
 	}
-	double compute_fitness(Individual& individual, const vector<Position>& starting_positions)
+	double compute_fitness(const Population& population, int i, const GeneticContext& context)
 	{
-		Position next_position_unit1 = individual.unit1_starting_position;
-		Position next_position_unit2 = individual.unit2_starting_position;
+		int cell_unit1 = population.unit1_start[i];
+		int cell_unit2 = population.unit2_start[i];
 
-		if (next_position_unit1 == next_position_unit2)
+		if (cell_unit1 == cell_unit2)
 			return -DBL_MAX;
 
-		unordered_set<Position, HashPosition> positions_visited(starting_positions.begin(), starting_positions.end());
-		positions_visited.emplace(next_position_unit1);
-		positions_visited.emplace(next_position_unit2);
-		for (int i = 0; i < GA_TURNS; i++)
+		Bitboard visited = context.visited;
+		visited.bits.set(cell_unit1);
+		visited.bits.set(cell_unit2);
+		for (int step = 0; step < GA_TURNS; step++)
 		{
-			next_position_unit1 = compute_next_position(individual.moves_unit1[i], next_position_unit1);
-			next_position_unit2 = compute_next_position(individual.moves_unit2[i], next_position_unit2);
+			cell_unit1 = context.next_cell[cell_unit1][population.moves_unit1[step][i]];
+			cell_unit2 = context.next_cell[cell_unit2][population.moves_unit2[step][i]];
 
-			if (next_position_unit1 == next_position_unit2)
+			if (cell_unit1 == cell_unit2)
 				return -DBL_MAX;
 
-			if (get_cells_level_ally(next_position_unit1) != 1 || get_cells_level_ally(next_position_unit2) != 1)
+			if (!context.level_1_cells.bits.test(cell_unit1) || !context.level_1_cells.bits.test(cell_unit2))
 				return -DBL_MAX;
 
-			positions_visited.emplace(next_position_unit1);
-			positions_visited.emplace(next_position_unit2);
+			visited.bits.set(cell_unit1);
+			visited.bits.set(cell_unit2);
 		}
 
-		return positions_visited.size() * 100.0 - get_distance(next_position_unit1, hq_enemy->p) - get_distance(next_position_unit2, hq_enemy->p);
+		return visited.count() * 100.0 - distances[cell_unit1][context.hq_enemy] - distances[cell_unit2][context.hq_enemy];
 	};
 	pair<vector<Position>, vector<Position>> get_optimal_paths(const Individual& individual)
 	{
@@ -2457,6 +4418,8 @@ public:
 	}
 	void execute_genetic_algorithm()
 	{
+		budget.start_phase(PHASE_GA);
+
 		if (turn == 1)
 		{
 			ga_best_paths = genetic_algorithm();
@@ -2520,125 +4483,617 @@ public:
 			}
 		}
 	}
-	pair<vector<Position>, vector<Position>> genetic_algorithm()
+	// One island of the GA, with its own populations and generator so islands can run on separate threads
+	Individual evolve_island(const GeneticContext& context, uint64_t seed, int& generation)
 	{
-		Stopwatch s("GA");
+		XorShift rng(seed);
+		Population populations[2];
+		Population* population = &populations[0];
+		Population* next = &populations[1];
 
-		vector<Position> available_starting_positions = get_frontier_spawn_ally(1);
-		unordered_map<Position, vector<Position>, HashPosition> spawnable_positions;
-		for (auto& pos : available_starting_positions)
-			spawnable_positions[pos] = spawnable_positions_around(pos);
+		const int elites = (10 * GA_POPULATION_SIZE) / 100;
+		const int parents = (50 * GA_POPULATION_SIZE) / 100;
 
-		//print_vector_positions(available_starting_positions, "starting pos");
-		//print_vector_positions(spawnable_positions_around(Position(10, 10)), "around 1010");
+		auto random_start = [&](Population& p, int i)
+		{
+			int start = rng.below(context.starts.size());
+			p.unit1_start[i] = context.starts[start];
+			p.unit2_start[i] = context.spawnable[start][rng.below(context.spawnable[start].size())];
+		};
 
-		Individual population[GA_POPULATION_SIZE];
 		for (int i = 0; i < GA_POPULATION_SIZE; i++)
 		{
-			Individual individual(1);
-
-			individual.unit1_starting_position = available_starting_positions[rand() % available_starting_positions.size()];
-			individual.unit2_starting_position = spawnable_positions.at(individual.unit1_starting_position)[rand() % spawnable_positions.at(individual.unit1_starting_position).size()];
-			individual.fitness = compute_fitness(individual, positions_ally);
-			population[i] = individual;
+			for (int step = 0; step < GA_TURNS; step++)
+			{
+				population->moves_unit1[step][i] = rng.below(5);
+				population->moves_unit2[step][i] = rng.below(5);
+			}
+			random_start(*population, i);
+			population->fitness[i] = compute_fitness(*population, i, context);
 		}
 
-		//cerr << "pop start" << endl;
-		//for (int i = 0; i < GA_POPULATION_SIZE; ++i)
-		//	cerr << population[i].print() << endl;
+		int order[GA_POPULATION_SIZE];
+		auto fitter = [&](int lhs, int rhs) { return population->fitness[lhs] > population->fitness[rhs]; };
 
-		int generation = 0;
-		while (generation++ < GA_MAX_GENERATIONS)
+		generation = 0;
+		while (generation++ < GA_MAX_GENERATIONS && !budget.phase_expired())
 		{
-			sort(population, population + GA_POPULATION_SIZE);
+			// Only the elites need to be ordered, parents are drawn from the better half
+			iota(order, order + GA_POPULATION_SIZE, 0);
+			nth_element(order, order + parents, order + GA_POPULATION_SIZE, fitter);
+			partial_sort(order, order + elites, order + parents, fitter);
 
-			Individual new_generation[GA_POPULATION_SIZE];
-			copy(population, population + (10 * GA_POPULATION_SIZE) / 100, new_generation);
-
-			//cerr << "Generation: " << generation << " ";
-			//cerr << "Fitness: " << population[0].fitness << endl;
+			for (int i = 0; i < GA_POPULATION_SIZE; i++)
+			{
+				int parent1 = order[i < elites ? i : rng.below(parents)];
+				int parent2 = i < elites ? parent1 : order[rng.below(parents)];
 
-			//cerr << "pop start" << endl;
-			//for (int i = 0; i < GA_POPULATION_SIZE; ++i)
-			//	cerr << population[i].print() << endl;
-			//cerr << "new gen start" << endl;
-			//for (int i = 0; i < GA_POPULATION_SIZE; ++i)
-			//	cerr << new_generation[i].print() << endl;
+				int draw = i < elites ? 0 : rng.below(100);
+				if (draw < 40)
+				{
+					next->unit1_start[i] = population->unit1_start[parent1];
+					next->unit2_start[i] = population->unit2_start[parent1];
+				}
+				else if (draw < 80)
+				{
+					next->unit1_start[i] = population->unit1_start[parent2];
+					next->unit2_start[i] = population->unit2_start[parent2];
+				}
+				else
+					random_start(*next, i);
 
-			for (int i = (10 * GA_POPULATION_SIZE) / 100; i < GA_POPULATION_SIZE; i++)
-			{
-				Individual parent1 = population[rand() % (50 * GA_POPULATION_SIZE) / 100];
-				Individual parent2 = population[rand() % (50 * GA_POPULATION_SIZE) / 100];
-				auto starting_positions = get_random_starting_position(parent1, parent2, available_starting_positions, spawnable_positions);
-				new_generation[i] = parent1.mate(parent2, starting_positions.first, starting_positions.second);
-				new_generation[i].fitness = compute_fitness(new_generation[i], positions_ally);
+				for (int step = 0; step < GA_TURNS; step++)
+				{
+					draw = i < elites ? 0 : rng.below(100);
+					if (draw < 40)
+					{
+						next->moves_unit1[step][i] = population->moves_unit1[step][parent1];
+						next->moves_unit2[step][i] = population->moves_unit2[step][parent1];
+					}
+					else if (draw < 80)
+					{
+						next->moves_unit1[step][i] = population->moves_unit1[step][parent2];
+						next->moves_unit2[step][i] = population->moves_unit2[step][parent2];
+					}
+					else
+					{
+						next->moves_unit1[step][i] = rng.below(5);
+						next->moves_unit2[step][i] = rng.below(5);
+					}
+				}
 
-				//cerr << "Mating " << i << " produced " << offspring.print() << endl;
+				next->fitness[i] = i < elites ? population->fitness[parent1] : compute_fitness(*next, i, context);
 			}
 
-			//cerr << "new gen after mating" << endl;
-			//for (int i = 0; i < GA_POPULATION_SIZE; ++i)
-			//	cerr << new_generation[i].print() << endl;
-			//cerr << "population before copy" << endl;
-			//for (int i = 0; i < GA_POPULATION_SIZE; ++i)
-			//	cerr << population[i].print() << endl;
+			swap(population, next);
+		}
 
-			copy(new_generation, new_generation + GA_POPULATION_SIZE, population);
+		int best = max_element(population->fitness, population->fitness + GA_POPULATION_SIZE) - population->fitness;
 
-			//cerr << "population after copy" << endl;
-			//for (int i = 0; i < GA_POPULATION_SIZE; ++i)
-			//	cerr << population[i].print() << endl;
+		Individual individual;
+		individual.unit1_starting_position = Bitboard::position(population->unit1_start[best]);
+		individual.unit2_starting_position = Bitboard::position(population->unit2_start[best]);
+		for (int step = 0; step < GA_TURNS; step++)
+		{
+			individual.moves_unit1[step] = moves[population->moves_unit1[step][best]];
+			individual.moves_unit2[step] = moves[population->moves_unit2[step][best]];
 		}
+		individual.fitness = population->fitness[best];
+		return individual;
+	}
+	pair<vector<Position>, vector<Position>> genetic_algorithm()
+	{
+		Stopwatch s("GA");
 
-		sort(population, population + GA_POPULATION_SIZE);
-		cerr << "Generation: " << generation << "\t";
-		cerr << "Fitness: " << population[0].fitness << "\n";
-		cerr << "Best candidate: " << population[0].print() << endl;
+		GeneticContext context;
+		for (auto& start : get_frontier_spawn_ally(1))
+		{
+			vector<int> spawnable;
+			for (auto& position : spawnable_positions_around(start))
+				spawnable.push_back(Bitboard::index(position));
 
-		return get_optimal_paths(population[0]);
+			context.starts.push_back(Bitboard::index(start));
+			context.spawnable.push_back(spawnable);
+		}
+		for (int cell = 0; cell < width * height; cell++)
+		{
+			for (int move = 0; move < 5; move++)
+				context.next_cell[cell][move] = Bitboard::index(compute_next_position(moves[move], Bitboard::position(cell)));
 
-		//cerr << "pop end" << endl;
-		//for (int i = 0; i < 10 * GA_POPULATION_SIZE / 100; ++i)
-		//	cerr << population[i].print() << endl;
+			if (get_cells_level_ally(Bitboard::position(cell)) == 1)
+				context.level_1_cells.bits.set(cell);
+		}
+		context.visited = Bitboard::from(positions_ally);
+		context.hq_enemy = Bitboard::index(hq_enemy->p);
+
+		// Islands evolve independently and the best individual found by any of them wins
+		Individual best[GA_ISLANDS];
+		int generations[GA_ISLANDS];
+		uint64_t seeds[GA_ISLANDS];
+		for (int island = 0; island < GA_ISLANDS; island++)
+			seeds[island] = ((uint64_t)rand() << 32) ^ (uint64_t)rand() ^ (island + 1);
+
+		vector<thread> threads;
+		for (int island = 1; island < GA_ISLANDS; island++)
+			threads.push_back(thread([&, island]() { best[island] = evolve_island(context, seeds[island], generations[island]); }));
+		best[0] = evolve_island(context, seeds[0], generations[0]);
+		for (auto& t : threads)
+			t.join();
+
+		int island = 0;
+		for (int i = 1; i < GA_ISLANDS; i++)
+			if (best[i].fitness > best[island].fitness)
+				island = i;
+
+		cerr << "Generation: " << generations[island] << "\t";
+		cerr << "Fitness: " << best[island].fitness << "\n";
+		cerr << "Best candidate: " << best[island].print() << endl;
+
+		return get_optimal_paths(best[island]);
 	}
 };
 
+#ifdef BENCH_DISTANCES
+// g++ -O2 -DBENCH_DISTANCES Bot.cpp
+// Compares the former Floyd-Warshall int matrix with the BFS uint8_t matrix on turn 1 setup and get_distance lookups
+int floyd_warshall_distances[width * height][width * height];
+void floyd_warshall(Game& g)
+{
+	const int dim = width * height;
+
+	for (int i = 0; i < dim; i++)
+		for (int j = 0; j < dim; j++)
+		{
+			Position pos1 = Position(i % width, i / width);
+			Position pos2 = Position(j % width, j / width);
+
+			int distance = INT_MAX;
+			if (Position::distance(pos1, pos2) == 1 && g.get_cell_info(pos1) != '#' && g.get_cell_info(pos2) != '#')
+				distance = 1;
+			else if (Position::distance(pos1, pos2) == 0)
+				distance = 0;
+
+			floyd_warshall_distances[i][j] = distance;
+		}
+
+	for (int k = 0; k < dim; ++k)
+		for (int i = 0; i < dim; ++i)
+			for (int j = 0; j <= i; ++j)
+				if (floyd_warshall_distances[i][k] != INT_MAX && floyd_warshall_distances[k][j] != INT_MAX && floyd_warshall_distances[i][k] + floyd_warshall_distances[k][j] < floyd_warshall_distances[i][j])
+					floyd_warshall_distances[j][i] = floyd_warshall_distances[i][j] = floyd_warshall_distances[i][k] + floyd_warshall_distances[k][j];
+}
+
 int main()
 {
-	Game g;
-	g.init();
+	const char* map[height] = {
+		"O.........#.",
+		"..........#.",
+		"....#...#.#.",
+		".......#.#..",
+		"#.##..#.....",
+		".....#.#....",
+		"....#.#.....",
+		".....#..##.#",
+		"..#.#.......",
+		".#.#...#....",
+		".#..........",
+		".#.........X"
+	};
+
+	static Game g;
+	for (int j = 0; j < height; j++)
+		for (int i = 0; i < width; i++)
+			g.cells_info[j][i] = map[j][i];
+	g.update_territory_bitboards();
+
+	auto now = []() { return chrono::high_resolution_clock::now(); };
+	auto microseconds = [](chrono::time_point<chrono::high_resolution_clock> start, chrono::time_point<chrono::high_resolution_clock> end) { return chrono::duration_cast<chrono::microseconds>(end - start).count(); };
+
+	auto start = now();
+	floyd_warshall(g);
+	auto end = now();
+	cerr << "Setup floyd_warshall: " << microseconds(start, end) << "us" << endl;
+
+	start = now();
+	for (int source = 0; source < width * height; source++)
+		g.compute_distances_from(source, g.board_passable);
+	end = now();
+	cerr << "Setup bfs: " << microseconds(start, end) << "us" << endl;
+
+	int mismatches = 0;
+	for (int i = 0; i < width * height; i++)
+		for (int j = 0; j < width * height; j++)
+			if ((floyd_warshall_distances[i][j] == INT_MAX ? unreachable_distance : floyd_warshall_distances[i][j]) != g.distances[i][j])
+				mismatches++;
+	cerr << "Mismatches: " << mismatches << endl;
+
+	const int lookups = 1 << 16;
+	const int rounds = 200;
+	vector<Position> queries;
+	srand(1);
+	for (int i = 0; i < 2 * lookups; i++)
+		queries.push_back(Position(rand() % width, rand() % height));
+
+	long long sum = 0;
+	start = now();
+	for (int round = 0; round < rounds; round++)
+		for (int i = 0; i < lookups; i++)
+			sum += floyd_warshall_distances[Bitboard::index(queries[2 * i])][Bitboard::index(queries[2 * i + 1])];
+	end = now();
+	cerr << "Lookups floyd_warshall: " << 1000.0 * microseconds(start, end) / (rounds * lookups) << "ns/call" << endl;
+
+	start = now();
+	for (int round = 0; round < rounds; round++)
+		for (int i = 0; i < lookups; i++)
+			sum += g.get_distance(queries[2 * i], queries[2 * i + 1]);
+	end = now();
+	cerr << "Lookups bfs: " << 1000.0 * microseconds(start, end) / (rounds * lookups) << "ns/call" << endl;
+
+	cerr << "Checksum: " << sum << endl;
+	return 0;
+}
+#elif defined(BENCH_SIMULATION)
+// g++ -O2 -DBENCH_SIMULATION Bot.cpp -o bench && ./bench
+// Random playouts on the simulator: units walk to the enemy HQ, a level 1 unit is trained at the frontier while income allows
+int main()
+{
+	const vector<string> map = {
+		"........#...",
+		"..........#.",
+		"....#.......",
+		"...#.......#",
+		"......#.....",
+		"..#.........",
+		".........#..",
+		".....#......",
+		"#.......#...",
+		".......#....",
+		".#..........",
+		"...#........"
+	};
+	const vector<Position> mine_spots = { Position(3, 2), Position(8, 9), Position(6, 3), Position(5, 8) };
+	const int games = 2000;
+	const int max_turns = 200;
+
+	static Simulation simulation;
+	simulation.init(map, mine_spots, Position(0, 0));
+	static Simulation sim;
 
 	srand(1);
+	long long turns = 0, commands_applied = 0;
+	int wins[3] = { 0, 0, 0 };
+	vector<Command> commands;
+
+	auto start = chrono::high_resolution_clock::now();
+	for (int game = 0; game < games; game++)
+	{
+		sim = simulation;
+		while (sim.winner < 0 && sim.turn < max_turns)
+			for (int player = 0; player < 2 && sim.winner < 0; player++)
+			{
+				commands.clear();
+				for (int id = 0; id < (int)sim.unit_cell.size(); id++)
+					if (sim.unit_cell[id] >= 0 && sim.units[player].bits.test(sim.unit_cell[id]))
+						commands.push_back(Command(MOVE, id, sim.hq[1 - player]));
+
+				vector<Position> frontier = (sim.active[player].dilate() & sim.passable - sim.territory[player]).to_positions();
+				if (sim.income(player) >= level_1_upkeep && !frontier.empty())
+					commands.push_back(Command(TRAIN, 1, frontier[rand() % frontier.size()]));
+
+				sim.apply_turn(player, commands);
+				commands_applied += commands.size();
+				turns++;
+			}
+		wins[sim.result() + 1]++;
+	}
+	auto end = chrono::high_resolution_clock::now();
+	double seconds = chrono::duration_cast<chrono::microseconds>(end - start).count() / 1e6;
+
+	cerr << "Games: " << games << " (player 0: " << wins[1] << ", player 1: " << wins[2] << ", draws: " << wins[0] << ")" << endl;
+	cerr << "Turns: " << turns << ", " << (long long)(turns / seconds) << " turns/s" << endl;
+	cerr << "Commands: " << commands_applied << ", " << (long long)(commands_applied / seconds) << " commands/s" << endl;
+	return 0;
+}
+#elif defined(TOURNAMENT)
+// g++ -O2 -pthread -DTOURNAMENT Bot.cpp -o tournament && ./tournament <games> [config A] [config B] [threads] 2>/dev/null
+// A config is the turn time in ms, 0 for no limit, optionally followed by ",noga" to skip the genetic opening
+// and, built with RHEA_PLANNER, ",rhea" to move units with the rolling horizon planner: "50", "0,noga", "50,rhea".
+// Every map is played twice with the seats swapped, on a Simulation of the referee rules.
+const int max_turns = 200;
+
+struct BotConfig
+{
+	string name;
+	double turn_time_ms;
+	bool use_ga;
+#ifdef RHEA_PLANNER
+	bool use_rhea;
+#endif
+};
 
+BotConfig parse_config(const string& name)
+{
+	BotConfig config = { name, TURN_TIME_MS, true };
+	istringstream(name) >> config.turn_time_ms;
+	config.use_ga = name.find("noga") == string::npos;
+#ifdef RHEA_PLANNER
+	config.use_rhea = name.find("rhea") != string::npos;
+#endif
+	return config;
+}
+
+// Point symmetric map with the HQ corners free and all passable cells connected
+void generate_map(mt19937& generator, Simulation& simulation)
+{
 	while (true)
 	{
-		g.update_game();
+		vector<string> map(height, string(width, '.'));
+		vector<Position> mine_spots;
+		for (int index = 0; index < width * height / 2; index++)
+		{
+			Position position = Bitboard::position(index);
+			Position mirror(width - 1 - position.x, height - 1 - position.y);
+			if (Position::distance(position, Position(0, 0)) <= 2 || Position::distance(position, Position(width - 1, height - 1)) <= 2)
+				continue;
+
+			int draw = generator() % 100;
+			if (draw < 15)
+				map[position.y][position.x] = map[mirror.y][mirror.x] = '#';
+			else if (draw < 19)
+			{
+				mine_spots.push_back(position);
+				mine_spots.push_back(mirror);
+			}
+		}
+
+		simulation.init(map, mine_spots, generator() % 2 ? Position(0, 0) : Position(width - 1, height - 1));
+
+		int reachable = 0;
+		for (int index = 0; index < width * height; index++)
+			reachable += simulation.distances[Bitboard::index(simulation.hq[0])][index] != unreachable_distance;
+		if (reachable == simulation.passable.count())
+			return;
+	}
+}
+
+struct TournamentStats
+{
+	int games = 0;
+	int wins_a = 0;
+	int wins_b = 0;
+	int draws = 0;
+	vector<double> latencies[2][PHASE_COUNT + 1]; // per config, per phase then the whole turn
+	int overruns[2] = { 0, 0 }; // turns past the referee's limit
+
+	void merge(const TournamentStats& other)
+	{
+		games += other.games;
+		wins_a += other.wins_a;
+		wins_b += other.wins_b;
+		draws += other.draws;
+		for (int config = 0; config < 2; config++)
+		{
+			for (int phase = 0; phase <= PHASE_COUNT; phase++)
+				latencies[config][phase].insert(latencies[config][phase].end(), other.latencies[config][phase].begin(), other.latencies[config][phase].end());
+			overruns[config] += other.overruns[config];
+		}
+	}
+};
+
+// Returns the winning seat, -1 for a draw
+int play_game(Simulation& simulation, const BotConfig* seats[2], int config_of_seat[2], TournamentStats& stats)
+{
+	stringstream inputs[2];
+	stringstream outputs[2];
+	unique_ptr<Game> bots[2];
+
+	for (int seat = 0; seat < 2; seat++)
+	{
+		bots[seat].reset(new Game(inputs[seat], outputs[seat]));
+		bots[seat]->turn_time_ms = seats[seat]->turn_time_ms;
+		bots[seat]->budget.unlimited = seats[seat]->turn_time_ms <= 0.0;
+
+		inputs[seat].str(simulation.init_input());
+		bots[seat]->init();
+		bots[seat]->use_ga = seats[seat]->use_ga;
+#ifdef RHEA_PLANNER
+		bots[seat]->use_rhea = seats[seat]->use_rhea;
+#endif
+	}
+
+	while (simulation.winner < 0 && simulation.turn < max_turns)
+		for (int seat = 0; seat < 2 && simulation.winner < 0; seat++)
 		{
-			Stopwatch s("Turn total time");
+			Game& bot = *bots[seat];
+			inputs[seat].clear();
+			inputs[seat].str(simulation.turn_input(seat));
+			outputs[seat].str("");
 
-			g.update_gamestate();
+			bot.update_game();
+			bot.play_turn();
 
-			if (g.use_ga)
+			vector<double>* latencies = stats.latencies[config_of_seat[seat]];
+			for (int phase = 0; phase < PHASE_COUNT; phase++)
+				if (bot.budget.phase_ms[phase] >= 0.0)
+					latencies[phase].push_back(bot.budget.phase_ms[phase]);
+
+			// The first turn has its own, much larger, limit, and a config without a limit never overruns
+			if (bot.turn > 1)
 			{
-				g.execute_genetic_algorithm();
-				goto send_commands;
+				latencies[PHASE_COUNT].push_back(bot.budget.elapsed_ms());
+				if (seats[seat]->turn_time_ms > 0.0 && bot.budget.elapsed_ms() > seats[seat]->turn_time_ms)
+					stats.overruns[config_of_seat[seat]]++;
 			}
 
-			g.move_units();
-			g.attempt_chainkill();
-			g.search_cuts();
+			string line = outputs[seat].str();
+			simulation.apply_turn(seat, Simulation::parse_commands(line.substr(0, line.find('\n'))));
+		}
+
+	return simulation.result();
+}
+
+double percentile(vector<double>& samples, double fraction)
+{
+	if (samples.empty())
+		return 0.0;
+
+	size_t rank = min(samples.size() - 1, (size_t)(fraction * samples.size()));
+	nth_element(samples.begin(), samples.begin() + rank, samples.end());
+	return samples[rank];
+}
+
+int main(int argc, char** argv)
+{
+	int games = argc > 1 ? atoi(argv[1]) : 100;
+	BotConfig configs[2] = { parse_config(argc > 2 ? argv[2] : "50"), parse_config(argc > 3 ? argv[3] : "50") };
+	int threads = argc > 4 ? atoi(argv[4]) : max(1u, thread::hardware_concurrency());
+
+	// The bots log every turn to cerr, far too much for thousands of games
+	cerr.setstate(ios::badbit);
+
+	atomic<int> next_game(0);
+	mutex stats_mutex;
+	TournamentStats stats;
+
+	auto worker = [&]()
+	{
+		TournamentStats local;
+		unique_ptr<Simulation> map(new Simulation());
+		unique_ptr<Simulation> simulation(new Simulation());
 
-			g.build_towers();
+		for (int game = next_game++; game < games; game = next_game++)
+		{
+			mt19937 generator(game / 2);
+			generate_map(generator, *map);
+			*simulation = *map;
+
+			// Odd games swap the seats on the same map
+			int config_of_seat[2] = { game % 2, 1 - game % 2 };
+			const BotConfig* seats[2] = { &configs[config_of_seat[0]], &configs[config_of_seat[1]] };
+
+			// Both games of a map start from the same rand() state, carrying it over from the previous game biased the pairs.
+			// rand() is shared by the threads, so this is only reproducible on a single thread.
+			srand(game / 2 + 1);
+			int winner = play_game(*simulation, seats, config_of_seat, local);
+			local.games++;
+			if (winner < 0)
+				local.draws++;
+			else if (config_of_seat[winner] == 0)
+				local.wins_a++;
+			else
+				local.wins_b++;
+		}
 
-			g.train_units_on_cuts();
-			g.train_units();
+		lock_guard<mutex> lock(stats_mutex);
+		stats.merge(local);
+	};
 
-			g.debug();
+	vector<thread> workers;
+	for (int i = 0; i < threads; i++)
+		workers.push_back(thread(worker));
+	for (auto& w : workers)
+		w.join();
+
+	// Wilson score interval at 95% on the score of A, draws counting half
+	double n = stats.games;
+	double score = (stats.wins_a + 0.5 * stats.draws) / n;
+	double z = 1.96;
+	double center = (score + z * z / (2 * n)) / (1 + z * z / n);
+	double margin = z * sqrt(score * (1 - score) / n + z * z / (4 * n * n)) / (1 + z * z / n);
+
+	cout << fixed << setprecision(3);
+	cout << "Games: " << stats.games << " on " << threads << " threads, A=" << configs[0].name << " B=" << configs[1].name << endl;
+	cout << "A wins: " << stats.wins_a << ", B wins: " << stats.wins_b << ", draws: " << stats.draws << endl;
+	cout << "A score: " << score << " [" << center - margin << ", " << center + margin << "] (95%)" << endl;
+#ifdef DEBUG_GAMESTATE
+	cout << "Chain moves: " << debug_chain_moves << endl;
+#endif
+
+	for (int config = 0; config < 2; config++)
+	{
+		cout << (config == 0 ? "A" : "B") << " latency ms (p50 / p95 / p99 / max), " << stats.overruns[config] << " turns over " << configs[config].turn_time_ms << "ms" << endl;
+		for (int phase = 0; phase <= PHASE_COUNT; phase++)
+		{
+			vector<double>& samples = stats.latencies[config][phase];
+			if (samples.empty())
+				continue;
 
-		send_commands:
-			g.send_commands();
+			cout << "  " << setw(14) << left << (phase < PHASE_COUNT ? phase_names[phase] : "Turn") << right
+				<< percentile(samples, 0.50) << " / " << percentile(samples, 0.95) << " / " << percentile(samples, 0.99) << " / " << *max_element(samples.begin(), samples.end())
+				<< " (" << samples.size() << " samples)" << endl;
 		}
 	}
 
 	return 0;
-}
\ No newline at end of file
+}
+#elif defined(REPLAY)
+// g++ -O2 -DREPLAY Bot.cpp -o replay && ./replay game.rec [--budget] 2>/dev/null
+// Plays a recording made with RECORD_INPUT turn by turn, printing the commands and the time spent per phase
+int main(int argc, char** argv)
+{
+	if (argc < 2)
+	{
+		cerr << "usage: replay <recording> [--budget]" << endl;
+		return 1;
+	}
+
+	ifstream recording(argv[1]);
+	string header;
+	unsigned int seed = 1;
+	getline(recording, header);
+	istringstream(header.substr(header.find(' ') + 1)) >> seed;
+	cin.rdbuf(recording.rdbuf());
+
+	Game g;
+	g.budget.unlimited = !(argc > 2 && string(argv[2]) == "--budget");
+	g.init();
+
+	srand(seed);
+
+	streambuf* output = cout.rdbuf();
+	while (g.update_game())
+	{
+		ostringstream commands;
+		cout.rdbuf(commands.rdbuf());
+		g.play_turn();
+		cout.rdbuf(output);
+
+		string line = commands.str();
+		line.erase(line.find_last_not_of('\n') + 1);
+		cout << "Turn " << g.turn << ": " << line << endl;
+
+		ostringstream timings;
+		timings << fixed << setprecision(2) << "  ";
+		for (int phase = 0; phase < PHASE_COUNT; phase++)
+			if (g.budget.phase_ms[phase] >= 0.0)
+				timings << phase_names[phase] << " " << g.budget.phase_ms[phase] << "ms, ";
+		timings << "total " << g.budget.elapsed_ms() << "ms";
+		cout << timings.str() << endl;
+	}
+
+	return 0;
+}
+#else
+// Build with -DRECORD_INPUT=\"game.rec\" to save the seed and the raw input of every turn for the replay
+int main()
+{
+	const unsigned int seed = 1;
+
+#ifdef RECORD_INPUT
+	ofstream recording(RECORD_INPUT);
+	recording << "seed " << seed << endl;
+	RecordingBuffer recording_buffer(cin.rdbuf(), recording);
+	cin.rdbuf(&recording_buffer);
+#endif
+
+	Game g;
+	g.init();
+
+	srand(seed);
+
+	while (g.update_game())
+		g.play_turn();
+
+	return 0;
+}
+#endif
\ No newline at end of file